@@ -0,0 +1,398 @@
+/*
+ * Surrey Space Centre urban change detection tool for SAR
+ * Copyright (C) 2013 Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include <glib.h>
+#include <ridgeutil.h>
+#include <ridgeio.h>
+
+#include "ridge-changemap.h"
+
+/* Benchmark harness for the stages of ridge-changemap.  Each stage is
+ * run several times on the same inputs, and the wall-clock time of
+ * each run is recorded.  The results are written as a JSON object,
+ * with the minimum, median and mean time of each stage in seconds,
+ * so that they can be compared between versions and machines.
+ *
+ * Output files are written into a scratch directory, and are
+ * overwritten by each run. */
+
+#define DEFAULT_REPEAT 3
+#define DEFAULT_DIRECTORY "bench-out"
+
+#define GETOPT_OPTIONS "d:hj:o:r:"
+
+struct option long_options[] =
+  {
+    {"directory", 1, 0, 'd'},
+    {"help", 0, 0, 'h'},
+    {"threads", 1, 0, 'j'},
+    {"output", 1, 0, 'o'},
+    {"repeat", 1, 0, 'r'},
+    {"density", 1, 0, 'D'},
+    {"nan", 1, 0, 'I'},
+    {"seed", 1, 0, 'S'},
+    {0, 0, 0, 0} /* Guard */
+  };
+
+static void
+usage (char *name, int status)
+{
+  printf (
+"Usage: %s [OPTION ...] CRDG PRE POST\n"
+"\n"
+"Options:\n"
+"  -r, --repeat=N  Run each stage N times [%i]\n"
+"  -j, --threads=N Use N threads [number of CPUs]\n"
+"  -d, --directory=DIR  Write output files into DIR [%s]\n"
+"  -o, --output=FILE  Write results to FILE [standard output]\n"
+"      --density=N, --nan=FRAC, --seed=N\n"
+"                  Record the ridge-changemap-gen parameters used to\n"
+"                  generate the input data in the results\n"
+"  -h, --help      Display this message and exit\n"
+"\n"
+"Times loading, calibration, change detection and each output format\n"
+"for a ridge data file CRDG and pre- and post-event images PRE and POST,\n"
+"and writes the results in JSON format.\n"
+"\n"
+"Please report bugs to %s.\n",
+name, DEFAULT_REPEAT, DEFAULT_DIRECTORY, PACKAGE_BUGREPORT);
+  exit (status);
+}
+
+/* -------------------------------------------------------------------------- */
+
+typedef struct _BenchContext BenchContext;
+struct _BenchContext {
+  const char *crdg_fn, *pre_fn, *post_fn, *directory;
+  int threads;
+
+  RioData *ridges;
+  RutSurface *pre, *post;
+  ChangeMap *changes;
+  ChangeMapBatch *batch;
+  Palette *palette;
+};
+
+typedef void (*BenchFunc) (BenchContext *ctx, const void *user_data);
+
+typedef struct _BenchExport BenchExport;
+struct _BenchExport {
+  const char *name;
+  void (*func) (const ChangeMapBatch *batch, OutputOptions *cfg);
+  int format;
+  const char *filename;
+};
+
+/* Stages, in the order that they are run */
+
+static void
+bench_load_ridges (BenchContext *ctx, const void *user_data)
+{
+  if (ctx->ridges != NULL) rio_data_destroy (ctx->ridges);
+  ctx->ridges = rio_data_from_file (ctx->crdg_fn);
+  if (ctx->ridges == NULL) {
+    fprintf (stderr, "ERROR: Failed to load ridge data from '%s': %s.\n",
+             ctx->crdg_fn, strerror (errno));
+    exit (2);
+  }
+}
+
+static void
+bench_load_images (BenchContext *ctx, const void *user_data)
+{
+  image_destroy (ctx->pre);
+  image_destroy (ctx->post);
+  ctx->pre = image_load_tiff (ctx->pre_fn);
+  ctx->post = image_load_tiff (ctx->post_fn);
+  if (ctx->pre == NULL || ctx->post == NULL) {
+    fprintf (stderr, "ERROR: Failed to load TIFF from '%s' or '%s'.\n",
+             ctx->pre_fn, ctx->post_fn);
+    exit (3);
+  }
+}
+
+static void
+bench_calibrate (BenchContext *ctx, const void *user_data)
+{
+  /* Setting an image discards the previous calibration */
+  change_map_set_pre_image (ctx->changes, ctx->pre);
+  change_map_calibrate (ctx->changes);
+}
+
+static void
+bench_get_line (BenchContext *ctx, const void *user_data)
+{
+  size_t N = change_map_get_num_lines (ctx->changes);
+  for (size_t i = 0; i < N; i++) {
+    change_map_line_free (change_map_get_line (ctx->changes, i));
+  }
+}
+
+static void
+bench_compute_all (BenchContext *ctx, const void *user_data)
+{
+  change_map_batch_free (ctx->batch);
+  ctx->batch = change_map_compute_all (ctx->changes);
+}
+
+static void
+bench_export (BenchContext *ctx, const void *user_data)
+{
+  const BenchExport *e = (const BenchExport *) user_data;
+  char *filename = g_build_filename (ctx->directory, e->filename, NULL);
+
+  OutputOptions cfg;
+  cfg.filename = filename;
+  cfg.format = e->format;
+  cfg.height = ctx->changes->height;
+  cfg.width = ctx->changes->width;
+  cfg.origin_row = cfg.origin_col = 0;
+  cfg.palette = ctx->palette;
+  cfg.colour_bins = 0;
+  cfg.compress = 0;
+  cfg.stripe_rows = 0;
+  cfg.threads = ctx->threads;
+  e->func (ctx->batch, &cfg);
+
+  g_free (filename);
+}
+
+static const BenchExport bench_exports[] = {
+  {"export_ridgelines_pdf", export_ridge_lines, FORMAT_PDF, "lines.pdf"},
+  {"export_ridgelines_png", export_ridge_lines, FORMAT_PNG, "lines.png"},
+  {"export_ridgelines_svg", export_ridge_lines, FORMAT_SVG, "lines.svg"},
+  {"export_ridgelines_geojson", export_ridge_lines, FORMAT_GEOJSON,
+   "lines.geojson"},
+  {"export_ridgemask_png", export_ridge_mask, FORMAT_PNG, "mask.png"},
+  {"export_ridgemask_tiff", export_ridge_mask, FORMAT_TIFF, "mask.tif"},
+  {"export_table", export_change_table, FORMAT_TABLE, "table.bin"},
+  {"export_table_csv", export_change_table, FORMAT_CSV, "table.csv"},
+  {"export_tiles", export_tile_pyramid, FORMAT_PNG, "tiles"},
+  {NULL, NULL, FORMAT_NONE, NULL},
+};
+
+/* -------------------------------------------------------------------------- */
+
+static int
+double_compare (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+/* Run func repeat times, and append its timings to json as a member
+ * of the "stages" object. */
+static void
+bench_run (GString *json, const char *name, BenchFunc func,
+           BenchContext *ctx, const void *user_data, int repeat)
+{
+  double *times = g_new (double, 2 * repeat);
+  double *sorted = times + repeat;
+  double total = 0;
+  for (int i = 0; i < repeat; i++) {
+    gint64 start = g_get_monotonic_time ();
+    func (ctx, user_data);
+    times[i] = (g_get_monotonic_time () - start) / 1e6;
+    total += times[i];
+  }
+  memcpy (sorted, times, repeat * sizeof (double));
+  qsort (sorted, repeat, sizeof (double), double_compare);
+
+  fprintf (stderr, "%-28s %10.4f s\n", name, sorted[0]);
+  g_string_append_printf (json, "%s\n    \"%s\": {\"min\": %.6f, "
+                          "\"median\": %.6f, \"mean\": %.6f, \"runs\": [",
+                          (json->str[json->len - 1] == '{') ? "" : ",",
+                          name, sorted[0], sorted[repeat / 2], total / repeat);
+  for (int i = 0; i < repeat; i++) {
+    g_string_append_printf (json, "%s%.6f", (i > 0) ? ", " : "", times[i]);
+  }
+  g_string_append (json, "]}");
+  g_free (times);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+main (int argc, char **argv)
+{
+  int c, status;
+  int cfg_repeat = DEFAULT_REPEAT;
+  int cfg_threads = 0;
+  const char *cfg_directory = DEFAULT_DIRECTORY;
+  const char *cfg_output_fn = NULL;
+  GString *generator = g_string_new (NULL); /* JSON members */
+  int density;
+  double nan_fraction;
+  unsigned int seed;
+
+  while (1) {
+    c = getopt_long (argc, argv, GETOPT_OPTIONS, long_options, NULL);
+    if (c == -1) break;
+
+    switch (c) {
+    case 'd':
+      cfg_directory = optarg;
+      break;
+    case 'h':
+      usage (argv[0], 0);
+      break;
+    case 'j':
+      status = sscanf (optarg, "%i", &cfg_threads);
+      if (status != 1 || cfg_threads < 1) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to -j option.\n\n",
+                 optarg);
+        usage (argv[0], 1);
+      }
+      break;
+    case 'o':
+      cfg_output_fn = optarg;
+      break;
+    case 'r':
+      status = sscanf (optarg, "%i", &cfg_repeat);
+      if (status != 1 || cfg_repeat < 1) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to -r option.\n\n",
+                 optarg);
+        usage (argv[0], 1);
+      }
+      break;
+    case 'D':
+      status = sscanf (optarg, "%i", &density);
+      if (status != 1 || density < 0) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to --density option.\n\n",
+                 optarg);
+        usage (argv[0], 1);
+      }
+      g_string_append_printf (generator, "%s\"density\": %i",
+                              generator->len ? ", " : "", density);
+      break;
+    case 'I':
+      status = sscanf (optarg, "%lf", &nan_fraction);
+      if (status != 1 || !(nan_fraction >= 0 && nan_fraction <= 1)) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to --nan option.\n\n",
+                 optarg);
+        usage (argv[0], 1);
+      }
+      g_string_append_printf (generator, "%s\"nan\": %g",
+                              generator->len ? ", " : "", nan_fraction);
+      break;
+    case 'S':
+      status = sscanf (optarg, "%u", &seed);
+      if (status != 1) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to --seed option.\n\n",
+                 optarg);
+        usage (argv[0], 1);
+      }
+      g_string_append_printf (generator, "%s\"seed\": %u",
+                              generator->len ? ", " : "", seed);
+      break;
+
+    case '?':
+      usage (argv[0], 1);
+    default:
+      g_assert_not_reached ();
+    }
+  }
+
+  if (argc - optind != 3) {
+    fprintf (stderr,
+             "ERROR: You must specify a ridge data file and pre- and post-event\n"
+             "SAR images.\n\n");
+    usage (argv[0], 1);
+  }
+
+  if (g_mkdir_with_parents (cfg_directory, 0777) != 0) {
+    fprintf (stderr, "ERROR: Could not create directory '%s': %s.\n",
+             cfg_directory, strerror (errno));
+    exit (4);
+  }
+
+  BenchContext ctx;
+  memset (&ctx, 0, sizeof (ctx));
+  ctx.crdg_fn = argv[optind];
+  ctx.pre_fn = argv[optind+1];
+  ctx.post_fn = argv[optind+2];
+  ctx.directory = cfg_directory;
+  ctx.threads = (cfg_threads > 0) ? cfg_threads : parallel_default_threads ();
+  ctx.palette = palette_new_default ();
+
+  GString *json = g_string_new ("{\n  \"stages\": {");
+
+  bench_run (json, "load_ridges", bench_load_ridges, &ctx, NULL, cfg_repeat);
+  bench_run (json, "load_images", bench_load_images, &ctx, NULL, cfg_repeat);
+
+  ctx.changes = change_map_new ();
+  change_map_set_threads (ctx.changes, ctx.threads);
+  change_map_set_ridge_data (ctx.changes, ctx.ridges);
+  change_map_set_pre_image (ctx.changes, ctx.pre);
+  change_map_set_post_image (ctx.changes, ctx.post);
+
+  bench_run (json, "calibrate", bench_calibrate, &ctx, NULL, cfg_repeat);
+  bench_run (json, "get_line", bench_get_line, &ctx, NULL, cfg_repeat);
+  bench_run (json, "compute_all", bench_compute_all, &ctx, NULL, cfg_repeat);
+  for (const BenchExport *e = bench_exports; e->name != NULL; e++) {
+    bench_run (json, e->name, bench_export, &ctx, e, cfg_repeat);
+  }
+
+  g_string_append_printf (json, "\n  },\n"
+                          "  \"version\": \"%s\",\n"
+                          "  \"rows\": %i,\n"
+                          "  \"cols\": %i,\n"
+                          "  \"lines\": %zu,\n"
+                          "  \"segments\": %zu,\n"
+                          "  \"threads\": %i,\n"
+                          "  \"repeat\": %i",
+                          PACKAGE_VERSION, ctx.changes->height,
+                          ctx.changes->width, ctx.batch->n_lines,
+                          ctx.batch->n_segments, ctx.threads, cfg_repeat);
+  if (generator->len > 0) {
+    g_string_append_printf (json, ",\n  \"generator\": {%s}", generator->str);
+  }
+  g_string_append (json, "\n}\n");
+  g_string_free (generator, TRUE);
+
+  /* Write results */
+  if (cfg_output_fn == NULL) {
+    fputs (json->str, stdout);
+  } else {
+    GError *err = NULL;
+    if (!g_file_set_contents (cfg_output_fn, json->str, json->len, &err)) {
+      fprintf (stderr, "ERROR: Could not write to '%s': %s.\n",
+               cfg_output_fn, err->message);
+      exit (4);
+    }
+  }
+
+  /* Cleanup */
+  g_string_free (json, TRUE);
+  change_map_batch_free (ctx.batch);
+  change_map_free (ctx.changes);
+  rio_data_destroy (ctx.ridges);
+  image_destroy (ctx.pre);
+  image_destroy (ctx.post);
+  palette_free (ctx.palette);
+  return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * Surrey Space Centre urban change detection tool for SAR
+ * Copyright (C) 2013 Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include <ridgeio.h>
+#include <ridgeutil.h>
+
+#include "ridge-changemap.h"
+
+/* Calibration values are cached in a key file next to the post-event
+ * image, in a group with one key per pre/post/nan_val/estimator
+ * combination.  Each key is a SHA-256 digest of the size,
+ * modification time and contents of both images, of the replacement
+ * value for non-finite pixels, of the calibration estimator, and of
+ * whether the images were held as compact images (which give slightly
+ * different values).
+ * Hashing the whole of each image would cost as much I/O as
+ * recalculating the calibration, so only the first and last
+ * CACHE_HASH_BLOCK bytes of each file are hashed. */
+
+#define CACHE_SUFFIX ".calibration"
+#define CACHE_GROUP "calibration"
+#define CACHE_HASH_BLOCK (1 << 20)
+
+static int
+cache_hash_file (GChecksum *checksum, const char *filename)
+{
+  struct stat st;
+  FILE *fp = fopen (filename, "rb");
+  if (fp == NULL) return FALSE;
+  if (fstat (fileno (fp), &st) != 0) {
+    fclose (fp);
+    return FALSE;
+  }
+
+  /* File identity */
+  guint64 size = st.st_size;
+  gint64 mtime = st.st_mtime;
+  g_checksum_update (checksum, (const guchar *) &size, sizeof (size));
+  g_checksum_update (checksum, (const guchar *) &mtime, sizeof (mtime));
+
+  /* File contents */
+  guchar *buf = g_malloc (CACHE_HASH_BLOCK);
+  size_t n = fread (buf, 1, CACHE_HASH_BLOCK, fp);
+  g_checksum_update (checksum, buf, n);
+  if (size > CACHE_HASH_BLOCK
+      && fseeko (fp, MAX (size - CACHE_HASH_BLOCK, CACHE_HASH_BLOCK),
+                 SEEK_SET) == 0) {
+    n = fread (buf, 1, CACHE_HASH_BLOCK, fp);
+    g_checksum_update (checksum, buf, n);
+  }
+  g_free (buf);
+
+  int status = !ferror (fp);
+  fclose (fp);
+  return status;
+}
+
+/* ================================================================
+ * API functions
+ * ================================================================ */
+
+/* Return the name of the calibration cache file for post_fn.  The
+ * result should be freed with g_free(). */
+char *
+calibration_cache_filename (const char *post_fn)
+{
+  g_assert (post_fn);
+  return g_strdup_printf ("%s" CACHE_SUFFIX, post_fn);
+}
+
+/* Return the calibration cache key for a pair of images and a
+ * calibration estimator, or NULL if either image can't be read.
+ * compact should be non-zero if the images are held as compact
+ * images.  The result should be freed with g_free(). */
+char *
+calibration_cache_key (const char *pre_fn, const char *post_fn,
+                       double nan_val, int estimator, double param,
+                       int compact)
+{
+  g_assert (pre_fn);
+  g_assert (post_fn);
+
+  GChecksum *checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  char *result = NULL;
+  if (cache_hash_file (checksum, pre_fn)
+      && cache_hash_file (checksum, post_fn)) {
+    char nan_str[G_ASCII_DTOSTR_BUF_SIZE];
+    g_ascii_dtostr (nan_str, sizeof (nan_str), nan_val);
+    g_checksum_update (checksum, (const guchar *) nan_str, strlen (nan_str));
+    /* Keys for the mean are unchanged from before estimators could be
+     * chosen, so existing caches stay valid. */
+    if (estimator != ESTIMATOR_MEAN) {
+      char param_str[G_ASCII_DTOSTR_BUF_SIZE];
+      g_ascii_dtostr (param_str, sizeof (param_str), param);
+      char *est_str = g_strdup_printf ("estimator=%i:%s", estimator, param_str);
+      g_checksum_update (checksum, (const guchar *) est_str, strlen (est_str));
+      g_free (est_str);
+    }
+    if (compact) g_checksum_update (checksum, (const guchar *) "compact", 7);
+    result = g_strdup (g_checksum_get_string (checksum));
+  }
+  g_checksum_free (checksum);
+  return result;
+}
+
+/* Look up key in the calibration cache file cache_fn.  Returns TRUE
+ * and sets *value if a valid calibration value was found. */
+int
+calibration_cache_lookup (const char *cache_fn, const char *key,
+                          double *value)
+{
+  g_assert (cache_fn);
+  g_assert (key);
+  g_assert (value);
+
+  GKeyFile *keys = g_key_file_new ();
+  GError *err = NULL;
+  int status = FALSE;
+
+  if (g_key_file_load_from_file (keys, cache_fn, G_KEY_FILE_NONE, NULL)) {
+    double v = g_key_file_get_double (keys, CACHE_GROUP, key, &err);
+    if (err == NULL && isnormal (v) && v > 0) {
+      *value = v;
+      status = TRUE;
+    }
+    g_clear_error (&err);
+  }
+
+  g_key_file_free (keys);
+  return status;
+}
+
+/* Store a calibration value for key in the calibration cache file
+ * cache_fn, preserving any other entries.  Returns FALSE if the file
+ * could not be written. */
+int
+calibration_cache_store (const char *cache_fn, const char *key,
+                         double value)
+{
+  g_assert (cache_fn);
+  g_assert (key);
+
+  GKeyFile *keys = g_key_file_new ();
+  g_key_file_load_from_file (keys, cache_fn, G_KEY_FILE_KEEP_COMMENTS, NULL);
+  g_key_file_set_double (keys, CACHE_GROUP, key, value);
+
+  gsize len;
+  char *data = g_key_file_to_data (keys, &len, NULL);
+  int status = g_file_set_contents (cache_fn, data, len, NULL);
+
+  g_free (data);
+  g_key_file_free (keys);
+  return status;
+}
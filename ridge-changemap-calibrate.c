@@ -0,0 +1,379 @@
+/*
+ * Surrey Space Centre urban change detection tool for SAR
+ * Copyright (C) 2013 Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <math.h>
+
+#include <glib.h>
+
+#include <ridgeio.h>
+#include <ridgeutil.h>
+
+#include "ridge-changemap.h"
+
+/* The calibration pass is split into bands of CALIBRATION_BAND_ROWS
+ * rows.  Each band is summed independently, and the band sums are
+ * then combined in band order, so that the result depends neither on
+ * the number of threads used nor on how many rows are passed to each
+ * calibrator_add_rows() call.
+ *
+ * A calibrator can calibrate several post-event images against the
+ * same pre-event image at once.  Each row of the pre-event image is
+ * then compared with the corresponding row of every post-event image
+ * while it is still in cache.
+ *
+ * By default, the calibration is the mean square ratio.  The robust
+ * estimators (quantiles, including the median, and the trimmed mean)
+ * are found in the same pass, without storing the ratio image, from a
+ * histogram of square ratios with logarithmically-spaced bins (see
+ * kernel_square_ratio_histogram()).  Each thread counts into its own
+ * histogram, and the counts are merged when the calibrator finishes;
+ * integer counts give the same result whatever the order of merging.
+ * Quantiles are interpolated linearly within a bin, and the trimmed
+ * mean uses the centre of each bin, so both are accurate to within
+ * the 0.4% relative width of a bin.
+ *
+ * Rows of compact images are decoded into a per-thread buffer one at
+ * a time, just before they are summed. */
+
+struct _Calibrator {
+  int height, width;
+  double nan_val;
+  int threads;
+  int n_posts;
+  int estimator;
+  double estimator_param;
+
+  int n_bands;
+  double *band_sums; /* n_posts arrays of length n_bands */
+  uint64_t *hists; /* threads x n_posts histograms, or NULL */
+};
+
+typedef struct _CalibratorTask CalibratorTask;
+struct _CalibratorTask {
+  Calibrator *cal;
+  int first_row, n_rows;
+  const float * const *pre_rows;
+  const float * const *post_rows;
+  const uint16_t * const *pre_codes; /* Used instead of rows, if set */
+  const uint16_t * const *post_codes;
+  int n_bands;
+  volatile gint next_band;
+};
+
+/* Get row i of the task's pre- or post-event rows, decoding it into
+ * buf if the rows are compact. */
+static const float *
+calibrator_row (const CalibratorTask *task, const float * const *rows,
+                const uint16_t * const *codes, size_t i, float *buf)
+{
+  if (codes == NULL) return rows[i];
+  compact_decode_row (codes[i], task->cal->width, buf);
+  return buf;
+}
+
+static void
+calibrator_band_thread (int thread, int n_threads, void *user_data)
+{
+  CalibratorTask *task = (CalibratorTask *) user_data;
+  Calibrator *cal = task->cal;
+  uint64_t *hists = NULL;
+  if (cal->hists != NULL) {
+    hists = cal->hists + (size_t) thread * cal->n_posts * KERNEL_HISTOGRAM_BINS;
+  }
+  float *pre_buf = NULL, *post_buf = NULL;
+  if (task->pre_codes != NULL) {
+    pre_buf = g_new (float, cal->width);
+    post_buf = g_new (float, cal->width);
+  }
+
+  while (1) {
+    int band = g_atomic_int_add (&task->next_band, 1);
+    if (band >= task->n_bands) break;
+
+    int start = band * CALIBRATION_BAND_ROWS;
+    int end = MIN (start + CALIBRATION_BAND_ROWS, task->n_rows);
+
+    /* Summation is carried out using Kahan sum. In this case,
+     * condition number is 1 because all values expected to be
+     * positive. */
+    double sum[cal->n_posts];
+    double c[cal->n_posts];
+    for (int k = 0; k < cal->n_posts; k++) sum[k] = c[k] = 0;
+
+    for (int i = start; i < end; i++) {
+      const float *pre_row = calibrator_row (task, task->pre_rows,
+                                             task->pre_codes, i, pre_buf);
+      for (int k = 0; k < cal->n_posts; k++) {
+        const float *post_row =
+          calibrator_row (task, task->post_rows, task->post_codes,
+                          (size_t) k*task->n_rows + i, post_buf);
+        double r = kernel_square_ratio_sum (pre_row, post_row,
+                                            cal->width, cal->nan_val);
+        double y = r - c[k];
+        double t = sum[k] + y;
+        c[k] = (t - sum[k]) - y;
+        sum[k] = t;
+
+        if (hists != NULL) {
+          kernel_square_ratio_histogram (pre_row, post_row,
+                                         cal->width, cal->nan_val,
+                                         hists + (size_t) k * KERNEL_HISTOGRAM_BINS);
+        }
+      }
+    }
+    for (int k = 0; k < cal->n_posts; k++) {
+      cal->band_sums[k*cal->n_bands
+                     + task->first_row / CALIBRATION_BAND_ROWS + band] = sum[k];
+    }
+  }
+
+  g_free (pre_buf);
+  g_free (post_buf);
+}
+
+static void
+calibrator_run (CalibratorTask *task)
+{
+  Calibrator *cal = task->cal;
+  g_assert (task->first_row % CALIBRATION_BAND_ROWS == 0);
+  g_assert (task->n_rows % CALIBRATION_BAND_ROWS == 0
+            || task->first_row + task->n_rows == cal->height);
+  g_assert (task->first_row + task->n_rows <= cal->height);
+
+  task->n_bands = ((task->n_rows + CALIBRATION_BAND_ROWS - 1)
+                   / CALIBRATION_BAND_ROWS);
+  task->next_band = 0;
+
+  if (task->n_bands == 0) return;
+  parallel_run (MIN (cal->threads, task->n_bands),
+                calibrator_band_thread, task);
+}
+
+/* Find quantile q of the n values counted in hist. */
+static double
+histogram_quantile (const uint64_t *hist, uint64_t n, double q)
+{
+  double rank = q * n;
+  uint64_t count = 0;
+  for (int b = 0; b < KERNEL_HISTOGRAM_BINS; b++) {
+    if (hist[b] > 0 && count + hist[b] >= rank) {
+      double lower = kernel_histogram_bin_edge (b);
+      double upper = kernel_histogram_bin_edge (b + 1);
+      return lower + (upper - lower) * (rank - count) / hist[b];
+    }
+    count += hist[b];
+  }
+  return kernel_histogram_bin_edge (KERNEL_HISTOGRAM_BINS);
+}
+
+/* Find the mean of the n values counted in hist, after discarding a
+ * fraction trim of the values from each end. */
+static double
+histogram_trimmed_mean (const uint64_t *hist, uint64_t n, double trim)
+{
+  uint64_t lo = (uint64_t) floor (trim * n);
+  uint64_t hi = n - lo;
+  uint64_t count = 0;
+  double sum = 0;
+  for (int b = 0; b < KERNEL_HISTOGRAM_BINS && count < hi; b++) {
+    uint64_t first = MAX (count, lo);
+    uint64_t last = MIN (count + hist[b], hi);
+    if (last > first) {
+      double centre = 0.5 * (kernel_histogram_bin_edge (b)
+                             + kernel_histogram_bin_edge (b + 1));
+      sum += (last - first) * centre;
+    }
+    count += hist[b];
+  }
+  return sum / (hi - lo);
+}
+
+/* ================================================================
+ * API functions
+ * ================================================================ */
+
+Calibrator *
+calibrator_new (int height, int width, double nan_val, int threads)
+{
+  return calibrator_new_series (height, width, nan_val, 1, threads);
+}
+
+/* Create a calibrator for n_posts post-event images. */
+Calibrator *
+calibrator_new_series (int height, int width, double nan_val, int n_posts,
+                       int threads)
+{
+  g_assert (n_posts > 0);
+
+  Calibrator *cal = g_new0 (Calibrator, 1);
+  cal->height = height;
+  cal->width = width;
+  cal->nan_val = nan_val;
+  cal->threads = (threads > 0) ? threads : parallel_default_threads ();
+  cal->n_posts = n_posts;
+  cal->estimator = ESTIMATOR_MEAN;
+
+  cal->n_bands = (height + CALIBRATION_BAND_ROWS - 1) / CALIBRATION_BAND_ROWS;
+  cal->band_sums = g_new0 (double, (size_t) n_posts * cal->n_bands);
+  return cal;
+}
+
+void
+calibrator_free (Calibrator *cal)
+{
+  if (!cal) return;
+  g_free (cal->band_sums);
+  g_free (cal->hists);
+  g_free (cal);
+}
+
+/* Choose the statistic of the square ratios that the calibrator
+ * returns.  For ESTIMATOR_QUANTILE, param is the quantile, between 0
+ * and 1; for ESTIMATOR_TRIMMED, it is the fraction of values
+ * discarded from each end, at least 0 and less than 0.5.  Must be
+ * called before any rows are added. */
+void
+calibrator_set_estimator (Calibrator *cal, int estimator, double param)
+{
+  g_assert (cal);
+  g_assert (cal->hists == NULL);
+  switch (estimator) {
+  case ESTIMATOR_MEAN:
+    break;
+  case ESTIMATOR_QUANTILE:
+    g_assert (param > 0 && param < 1);
+    break;
+  case ESTIMATOR_TRIMMED:
+    g_assert (param >= 0 && param < 0.5);
+    break;
+  default:
+    g_assert_not_reached ();
+  }
+  cal->estimator = estimator;
+  cal->estimator_param = param;
+
+  if (estimator != ESTIMATOR_MEAN) {
+    cal->hists = g_new0 (uint64_t, (size_t) cal->threads * cal->n_posts
+                         * KERNEL_HISTOGRAM_BINS);
+  }
+}
+
+/* Add n_rows rows of image data, starting at first_row.  first_row
+ * must lie on a band boundary, and n_rows must be a whole number of
+ * bands unless the rows run to the bottom of the image.  For a series
+ * calibrator, post_rows holds n_rows rows for each post-event image in
+ * turn. */
+void
+calibrator_add_rows (Calibrator *cal, int first_row, int n_rows,
+                     const float * const *pre_rows,
+                     const float * const *post_rows)
+{
+  g_assert (cal);
+  g_assert (pre_rows && post_rows);
+
+  CalibratorTask task;
+  task.cal = cal;
+  task.first_row = first_row;
+  task.n_rows = n_rows;
+  task.pre_rows = pre_rows;
+  task.post_rows = post_rows;
+  task.pre_codes = task.post_codes = NULL;
+  calibrator_run (&task);
+}
+
+/* As calibrator_add_rows(), but for rows of compact images, which
+ * are decoded as they are used. */
+void
+calibrator_add_compact_rows (Calibrator *cal, int first_row, int n_rows,
+                             const uint16_t * const *pre_rows,
+                             const uint16_t * const *post_rows)
+{
+  g_assert (cal);
+  g_assert (pre_rows && post_rows);
+
+  CalibratorTask task;
+  task.cal = cal;
+  task.first_row = first_row;
+  task.n_rows = n_rows;
+  task.pre_rows = task.post_rows = NULL;
+  task.pre_codes = pre_rows;
+  task.post_codes = post_rows;
+  calibrator_run (&task);
+}
+
+/* Return the calibration over all of the rows added so far. */
+double
+calibrator_finish (Calibrator *cal)
+{
+  double result;
+  g_assert (cal);
+  g_assert (cal->n_posts == 1);
+  calibrator_finish_series (cal, &result);
+  return result;
+}
+
+/* Set calibrations[k] to the calibration for post-event image k, over
+ * all of the rows added so far. */
+void
+calibrator_finish_series (Calibrator *cal, double *calibrations)
+{
+  g_assert (cal);
+  g_assert (calibrations);
+
+  /* Combine band sums in a fixed order, again using Kahan sum. */
+  double N = (double) cal->height * (double) cal->width;
+  for (int k = 0; k < cal->n_posts; k++) {
+    const double *band_sums = cal->band_sums + (size_t) k * cal->n_bands;
+    double sum = 0;
+    double c = 0;
+    for (int i = 0; i < cal->n_bands; i++) {
+      double y = band_sums[i] - c;
+      double t = sum + y;
+      c = (t - sum) - y;
+      sum = t;
+    }
+    calibrations[k] = sum / N;
+  }
+  if (cal->hists == NULL) return;
+
+  /* Merge the per-thread histograms for each post-event image */
+  uint64_t *hist = g_new (uint64_t, KERNEL_HISTOGRAM_BINS);
+  for (int k = 0; k < cal->n_posts; k++) {
+    memset (hist, 0, KERNEL_HISTOGRAM_BINS * sizeof (uint64_t));
+    uint64_t n = 0;
+    for (int t = 0; t < cal->threads; t++) {
+      const uint64_t *h = cal->hists
+        + ((size_t) t * cal->n_posts + k) * KERNEL_HISTOGRAM_BINS;
+      for (int b = 0; b < KERNEL_HISTOGRAM_BINS; b++) {
+        hist[b] += h[b];
+        n += h[b];
+      }
+    }
+    g_assert (n > 0);
+
+    if (cal->estimator == ESTIMATOR_QUANTILE) {
+      calibrations[k] = histogram_quantile (hist, n, cal->estimator_param);
+    } else {
+      calibrations[k] = histogram_trimmed_mean (hist, n, cal->estimator_param);
+    }
+  }
+  g_free (hist);
+}
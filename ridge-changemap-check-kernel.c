@@ -0,0 +1,141 @@
+/*
+ * Surrey Space Centre urban change detection tool for SAR
+ * Copyright (C) 2013 Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <float.h>
+
+#include <glib.h>
+#include <ridgeutil.h>
+#include <ridgeio.h>
+
+#include "ridge-changemap.h"
+
+/* Checks that every square ratio sum kernel that the CPU supports,
+ * and kernel_square_ratio_sum(), which uses the fastest of them,
+ * agree with the scalar kernel.  Rows of random length (so that the
+ * vector kernels' scalar tails are exercised) and random alignment
+ * are filled with speckle-like values, mixed with NaN, +/-Inf, zero
+ * and denormal floats.  The sums must agree to within a relative
+ * error of CHECK_TOLERANCE, which is the accuracy documented in
+ * ridge-changemap-kernel.c. */
+
+#define CHECK_TOLERANCE 1e-12
+#define CHECK_N_ROWS 2000
+#define CHECK_MAX_LENGTH 1027
+#define CHECK_SPECIAL_FRACTION 0.05
+#define CHECK_SEED 1
+
+static float
+random_value (GRand *rand)
+{
+  if (g_rand_double (rand) >= CHECK_SPECIAL_FRACTION) {
+    /* Single-look amplitude speckle, with occasional large values */
+    return g_rand_double_range (rand, 0, 1000) * g_rand_double (rand);
+  }
+  switch (g_rand_int_range (rand, 0, 6)) {
+  case 0: return NAN;
+  case 1: return INFINITY;
+  case 2: return -INFINITY;
+  case 3: return 0;
+  case 4: return FLT_MIN / (float) g_rand_int_range (rand, 2, 1 << 20);
+  default: return -FLT_MIN / 2;
+  }
+}
+
+static const char *kernel_names[KERNEL_N_KERNELS] = {
+  "scalar", "sse2", "avx2",
+};
+
+static int
+check_sum (const char *name, double expected, double actual, int n,
+           double nan_val)
+{
+  if (isnan (expected) || isnan (actual)) {
+    if (isnan (expected) && isnan (actual)) return TRUE;
+  } else if (fabs (actual - expected)
+             <= CHECK_TOLERANCE * MAX (fabs (expected), DBL_MIN)) {
+    return TRUE;
+  }
+  fprintf (stderr, "FAIL: %s, n = %i, nan_val = %g: expected %.17g, got %.17g\n",
+           name, n, nan_val, expected, actual);
+  return FALSE;
+}
+
+/* Check each supported kernel on one row.  Returns the number of
+ * failures. */
+static int
+check_row (const float *pre, const float *post, int n, double nan_val)
+{
+  int n_failed = 0;
+  double expected = kernel_square_ratio_sum_with (KERNEL_SCALAR, pre, post,
+                                                  n, nan_val);
+  for (int k = KERNEL_SCALAR + 1; k < KERNEL_N_KERNELS; k++) {
+    if (!kernel_square_ratio_sum_supported (k)) continue;
+    double actual = kernel_square_ratio_sum_with (k, pre, post, n, nan_val);
+    if (!check_sum (kernel_names[k], expected, actual, n, nan_val)) {
+      n_failed++;
+    }
+  }
+  double actual = kernel_square_ratio_sum (pre, post, n, nan_val);
+  if (!check_sum ("default", expected, actual, n, nan_val)) n_failed++;
+  return n_failed;
+}
+
+int
+main (int argc, char **argv)
+{
+  static const double nan_vals[] = { 0, 1, NAN };
+  const int n_nan_vals = sizeof (nan_vals) / sizeof (nan_vals[0]);
+
+  for (int k = 0; k < KERNEL_N_KERNELS; k++) {
+    printf ("%s: %s\n", kernel_names[k],
+            kernel_square_ratio_sum_supported (k) ? "checked" : "skipped");
+  }
+
+  GRand *rand = g_rand_new_with_seed (CHECK_SEED);
+  /* Allow for an offset of up to 7 elements, so rows are misaligned */
+  float *pre = g_new (float, CHECK_MAX_LENGTH + 8);
+  float *post = g_new (float, CHECK_MAX_LENGTH + 8);
+  int n_failed = 0;
+
+  for (int i = 0; i < CHECK_N_ROWS; i++) {
+    int n = g_rand_int_range (rand, 0, CHECK_MAX_LENGTH + 1);
+    int offset = g_rand_int_range (rand, 0, 8);
+    for (int j = 0; j < n; j++) {
+      pre[offset + j] = random_value (rand);
+      post[offset + j] = random_value (rand);
+    }
+    for (int k = 0; k < n_nan_vals; k++) {
+      n_failed += check_row (pre + offset, post + offset, n, nan_vals[k]);
+    }
+  }
+
+  g_free (pre);
+  g_free (post);
+  g_rand_free (rand);
+
+  if (n_failed > 0) {
+    fprintf (stderr, "%i checks failed.\n", n_failed);
+    return 1;
+  }
+  return 0;
+}
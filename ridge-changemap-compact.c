@@ -0,0 +1,138 @@
+/*
+ * Surrey Space Centre urban change detection tool for SAR
+ * Copyright (C) 2013 Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <math.h>
+
+#include <glib.h>
+
+#include <ridgeio.h>
+#include <ridgeutil.h>
+
+#include "ridge-changemap.h"
+
+/* Compact images hold each pixel as a 16-bit code instead of a
+ * 32-bit float, halving the memory needed for the pre- and
+ * post-event images.  The top bit of a code is the sign of the
+ * value, and the other 15 bits hold its base 2 logarithm, quantised
+ * into COMPACT_STEPS steps per octave starting from 2^COMPACT_MIN_LOG2.
+ * Code 0 (with either sign) stands for any value that is zero or not
+ * finite, and decodes to NaN, so it is replaced by the non-finite
+ * value just as the original value would have been.
+ *
+ * Values with magnitudes between 2^-32 and 2^32 are decoded with a
+ * relative error of at most 2^(1/1024) - 1, or about 0.068%, so a
+ * square ratio computed from a compact pair of images is within about
+ * 0.27% of the value computed from the original images.  Smaller and
+ * larger magnitudes are clamped to the range.
+ *
+ * Decoding is a single lookup in a table of all 65536 codes (256 KiB,
+ * so it stays in cache), which is filled in when the first compact
+ * image is created. */
+
+#define COMPACT_MIN_LOG2 (-32)
+#define COMPACT_STEPS 512
+#define COMPACT_SIGN 0x8000
+#define COMPACT_MAX_CODE 0x7fff
+
+float compact_decode_table[1 << 16];
+
+static void
+compact_init (void)
+{
+  static gsize initialised = 0;
+  if (!g_once_init_enter (&initialised)) return;
+
+  for (int code = 0; code < (1 << 16); code++) {
+    int m = code & COMPACT_MAX_CODE;
+    float v = NAN;
+    if (m != 0) {
+      v = exp2 ((double) (m - 1) / COMPACT_STEPS + COMPACT_MIN_LOG2);
+      if (code & COMPACT_SIGN) v = -v;
+    }
+    compact_decode_table[code] = v;
+  }
+  g_once_init_leave (&initialised, 1);
+}
+
+/* ================================================================
+ * API functions
+ * ================================================================ */
+
+/* Return the code for the value v. */
+uint16_t
+compact_encode (float v)
+{
+  /* Subnormal floats are kept (and clamped), because the float path
+   * widens them to normal doubles. */
+  if (v == 0 || !isfinite (v)) return 0;
+  double x = ((log2 (fabs (v)) - COMPACT_MIN_LOG2) * COMPACT_STEPS) + 1;
+  x = CLAMP (round (x), 1, COMPACT_MAX_CODE);
+  return ((v < 0) ? COMPACT_SIGN : 0) | (uint16_t) x;
+}
+
+/* Decode n codes into buf. */
+void
+compact_decode_row (const uint16_t *codes, int n, float *buf)
+{
+  for (int i = 0; i < n; i++) buf[i] = compact_decode (codes[i]);
+}
+
+/* Read the height x width window of the image with its top left
+ * corner at (row, col) into a new compact image, which should be
+ * freed with compact_image_free().  The image is read and encoded a
+ * row at a time, so its float pixel data is never held in memory.
+ * Returns NULL if the image could not be read. */
+CompactImage *
+compact_image_read (StreamImage *img, int row, int col, int height, int width)
+{
+  uint32_t rows, cols;
+  g_assert (img);
+  stream_image_get_size (img, &rows, &cols);
+  g_assert (row >= 0 && height > 0 && row + height <= rows);
+  g_assert (col >= 0 && width > 0 && col + width <= cols);
+
+  compact_init ();
+
+  CompactImage *result = g_new0 (CompactImage, 1);
+  result->rows = height;
+  result->cols = width;
+  result->data = g_new (uint16_t, (size_t) height * width);
+
+  float *buf = g_new (float, cols);
+  for (int i = 0; i < height; i++) {
+    if (!stream_image_read_row (img, row + i, buf)) {
+      compact_image_free (result);
+      result = NULL;
+      break;
+    }
+    uint16_t *dest = COMPACT_IMAGE_ROW (result, i);
+    for (int j = 0; j < width; j++) dest[j] = compact_encode (buf[col + j]);
+  }
+  g_free (buf);
+  return result;
+}
+
+void
+compact_image_free (CompactImage *img)
+{
+  if (!img) return;
+  g_free (img->data);
+  g_free (img);
+}
@@ -32,85 +32,365 @@
 
 /* ---------------------------------------------------------------- */
 
-/* FIXME this should be made much more general and preferably
- * configurable */
+static void
+set_rgb24_colour (cairo_t *cr, uint32_t v)
+{
+  cairo_set_source_rgb (cr, ((v >> 16) & 0xff) / 255.0,
+                        ((v >> 8) & 0xff) / 255.0, (v & 0xff) / 255.0);
+}
 
-typedef struct _PaletteEntry PaletteEntry;
-struct _PaletteEntry {
-  float v;
-  uint8_t r, g, b;
-};
+void
+set_damage_colour (cairo_t *cr, const Palette *palette, double d)
+{
+  set_rgb24_colour (cr, palette_lookup (palette, d));
+}
 
-#if 0
-static const PaletteEntry PALETTE[] = {
-  { 0, 0, 0, 0},
-  { 0.75, 255, 0, 0},
-  { 1.00, 255, 255, 0},
-  { NAN,  0,   0,   0   },
-};
+void
+set_background_colour (cairo_t *cr, const Palette *palette)
+{
+  set_rgb24_colour (cr, palette->background);
+}
 
-static const PaletteEntry PALETTE[] = {
-  { 0.00, 230,230,230},
-  { 0.50, 191,191,191},
-  { 0.75, 128,128,128},
-  { 1.00, 0,0,255},
-  { NAN, 255, 255, 255},
-};
-#endif
-
-static const PaletteEntry PALETTE[] = {
-  { 0.00, 242,242,242},
-  { 0.50, 153,153,153},
-  { 0.75, 64,64,64},
-  { 1.00, 0,0,255},
-  { NAN, 255, 255, 255},
+void
+convert_coords (const ChangeMapBatch *batch, size_t idx, double *x, double *y)
+{
+  *x = batch->coords[1][idx] / 128.0;
+  *y = batch->coords[0][idx] / 128.0;
+}
+
+/* Return the colour bin, out of n_bins equal divisions of the
+ * palette's range, for change value d. */
+static int
+colour_bin (const Palette *palette, double d, int n_bins)
+{
+  double x = d * palette->scale / (PALETTE_LUT_SIZE - 1);
+  if (!(x > 0)) return 0;
+  return MIN ((int) (x * n_bins), n_bins - 1);
+}
+
+/* Draw each segment as a separate stroke in its own colour.  If lines
+ * is non-NULL, only the n_lines lines it lists are drawn; otherwise,
+ * every line is drawn. */
+static void
+draw_segments (cairo_t *cr, const ChangeMapBatch *batch,
+               const Palette *palette, const size_t *lines, size_t n_lines)
+{
+  for (size_t k = 0; k < n_lines; k++) {
+    size_t i = lines ? lines[k] : k;
+    for (size_t j = batch->offsets[i]; j < batch->offsets[i+1]; j++) {
+      double x, y;
+
+      set_damage_colour (cr, palette, batch->change[j]);
+
+      convert_coords (batch, j + i, &x, &y);
+      cairo_move_to (cr, x, y);
+      convert_coords (batch, j + i + 1, &x, &y);
+      cairo_line_to (cr, x, y);
+
+      cairo_stroke (cr);
+    }
+  }
+}
+
+/* Quantise change into n_bins colour bins */
+static uint16_t *
+colour_bins_new (const ChangeMapBatch *batch, const Palette *palette,
+                 int n_bins)
+{
+  uint16_t *bins = g_new (uint16_t, MAX (batch->n_segments, 1));
+  for (size_t j = 0; j < batch->n_segments; j++) {
+    bins[j] = colour_bin (palette, batch->change[j], n_bins);
+  }
+  return bins;
+}
+
+/* A run of consecutive segments of one line in the same colour bin,
+ * starting at segment start of line line. */
+typedef struct _SegmentRun SegmentRun;
+struct _SegmentRun {
+  size_t line, start;
 };
 
-void
-set_damage_colour (cairo_t *cr, double d)
+/* Draw all of the segments in each of the n_bins colour bins with a
+ * single stroke.  Runs of consecutive segments in the same bin are
+ * drawn as polylines.  Bins are drawn in order of increasing change,
+ * so that the greatest change is drawn on top.  The runs are first
+ * bucketed by bin with a counting sort, so the cost doesn't depend on
+ * the number of bins.  lines and n_lines are as for
+ * draw_segments(). */
+static void
+draw_segments_binned (cairo_t *cr, const ChangeMapBatch *batch,
+                      const Palette *palette, const uint16_t *bins,
+                      int n_bins, const size_t *lines, size_t n_lines)
 {
-  d = fmax (0, d);
-  PaletteEntry start, end;
-  start = PALETTE[0];
-  for (int i = 1; !isnan(PALETTE[i].v); i++) {
-    end = PALETTE[i];
-    if (d <= end.v) break;
-    start = end;
+  cairo_set_line_join (cr, CAIRO_LINE_JOIN_ROUND);
+
+  /* Count the runs in each bin */
+  size_t *bin_start = g_new0 (size_t, n_bins + 1);
+  for (size_t k = 0; k < n_lines; k++) {
+    size_t i = lines ? lines[k] : k;
+    for (size_t j = batch->offsets[i]; j < batch->offsets[i+1]; j++) {
+      if (j == batch->offsets[i] || bins[j-1] != bins[j]) {
+        bin_start[bins[j] + 1]++;
+      }
+    }
+  }
+  for (int b = 0; b < n_bins; b++) bin_start[b+1] += bin_start[b];
+
+  /* Bucket the runs, keeping them in drawing order within each bin */
+  SegmentRun *runs = g_new (SegmentRun, MAX (bin_start[n_bins], 1));
+  size_t *fill = g_new (size_t, n_bins);
+  memcpy (fill, bin_start, n_bins * sizeof (size_t));
+  for (size_t k = 0; k < n_lines; k++) {
+    size_t i = lines ? lines[k] : k;
+    for (size_t j = batch->offsets[i]; j < batch->offsets[i+1]; j++) {
+      if (j == batch->offsets[i] || bins[j-1] != bins[j]) {
+        SegmentRun *run = &runs[fill[bins[j]]++];
+        run->line = i;
+        run->start = j;
+      }
+    }
+  }
+  g_free (fill);
+
+  for (int b = 0; b < n_bins; b++) {
+    if (bin_start[b] == bin_start[b+1]) continue;
+
+    for (size_t r = bin_start[b]; r < bin_start[b+1]; r++) {
+      size_t i = runs[r].line;
+      size_t j = runs[r].start;
+      double x, y;
+      convert_coords (batch, j + i, &x, &y);
+      cairo_move_to (cr, x, y);
+      for (; j < batch->offsets[i+1] && bins[j] == b; j++) {
+        convert_coords (batch, j + i + 1, &x, &y);
+        cairo_line_to (cr, x, y);
+      }
+    }
+
+    /* Use the colour at the centre of the bin */
+    int idx = (int) ((b + 0.5) / n_bins * (PALETTE_LUT_SIZE - 1) + 0.5);
+    set_rgb24_colour (cr, palette->lut[idx]);
+    cairo_stroke (cr);
   }
-  double x = (d - start.v) / (end.v - start.v);
-  double r = (x * end.r + (1-x) * start.r) / 255;
-  double g = (x * end.g + (1-x) * start.g) / 255;
-  double b = (x * end.b + (1-x) * start.b) / 255;
 
-  cairo_set_source_rgb (cr, r, g, b);
+  g_free (runs);
+  g_free (bin_start);
 }
 
-void
-set_background_colour (cairo_t *cr)
+/* Draw the ridge lines onto cr, using the options in cfg.  The
+ * output's origin is mapped to (cfg->origin_row, cfg->origin_col) in
+ * ridge coordinates.  bins may be NULL if cfg->colour_bins is zero. */
+static void
+draw_ridge_lines (cairo_t *cr, const ChangeMapBatch *batch,
+                  OutputOptions *cfg, const uint16_t *bins,
+                  const size_t *lines, size_t n_lines)
+{
+  cairo_set_line_width (cr, 1);
+  cairo_set_line_cap (cr, CAIRO_LINE_CAP_ROUND);
+
+  set_background_colour (cr, cfg->palette);
+  cairo_paint (cr);
+
+  cairo_translate (cr, -(double) cfg->origin_col, -(double) cfg->origin_row);
+
+  if (cfg->colour_bins > 0) {
+    draw_segments_binned (cr, batch, cfg->palette, bins, cfg->colour_bins,
+                          lines, n_lines);
+  } else {
+    draw_segments (cr, batch, cfg->palette, lines, n_lines);
+  }
+}
+
+/* ---------------------------------------------------------------- */
+
+/* Images larger than cairo's maximum surface size, or any image if
+ * cfg->stripe_rows is set, are rendered to PNG in horizontal stripes
+ * of stripe_rows rows, each of which is encoded as soon as it has been
+ * drawn.  Before rendering, the lines or pixels are bucketed by the
+ * stripes that they touch.  Stripes wider than cairo's limit are drawn
+ * in several chunks, directly into the stripe buffer. */
+
+#define CAIRO_MAX_SIZE 32767
+#define DEFAULT_STRIPE_ROWS 256
+
+/* Margin around each line's bounding box, in pixels, to allow for the
+ * line width and antialiasing. */
+#define STRIPE_MARGIN 2
+
+static int
+use_stripes (OutputOptions *cfg)
 {
-  int i;
-  PaletteEntry p;
-  for (i = 0, p = PALETTE[i]; !isnan(p.v); p = PALETTE[++i]);
-  cairo_set_source_rgb (cr, p.r/255.0, p.g/255.0, p.b/255.0);
+  return (cfg->format == FORMAT_PNG
+          && (cfg->stripe_rows > 0
+              || cfg->width > CAIRO_MAX_SIZE
+              || cfg->height > CAIRO_MAX_SIZE));
 }
 
-void
-convert_coords (ChangeMapLine *l, int idx, double *x, double *y)
+static size_t
+stripe_rows (OutputOptions *cfg)
+{
+  size_t rows = (cfg->stripe_rows > 0) ? cfg->stripe_rows : DEFAULT_STRIPE_ROWS;
+  return MIN (rows, MIN (cfg->height, CAIRO_MAX_SIZE));
+}
+
+/* Sort the lines in batch into the stripes of n_rows rows that they
+ * may touch, in an image of height rows starting at row0.  Works like
+ * ridge_pixels_bucket(). */
+static size_t *
+ridge_lines_bucket (const ChangeMapBatch *batch, size_t row0, size_t height,
+                    size_t n_rows, size_t **stripe_start)
+{
+  size_t n_stripes = (height + n_rows - 1) / n_rows;
+  size_t *first = g_new (size_t, MAX (batch->n_lines, 1));
+  size_t *last = g_new (size_t, MAX (batch->n_lines, 1));
+  size_t *start = g_new0 (size_t, n_stripes + 1);
+
+  for (size_t i = 0; i < batch->n_lines; i++) {
+    size_t p0 = batch->offsets[i] + i;
+    size_t p1 = batch->offsets[i+1] + i;
+    uint32_t min_row = G_MAXUINT32, max_row = 0;
+    for (size_t p = p0; p <= p1; p++) {
+      min_row = MIN (min_row, batch->coords[0][p]);
+      max_row = MAX (max_row, batch->coords[0][p]);
+    }
+    double top = min_row / 128.0 - row0 - STRIPE_MARGIN;
+    double bottom = max_row / 128.0 - row0 + STRIPE_MARGIN;
+    if (bottom < 0) {
+      first[i] = 1;
+      last[i] = 0;
+      continue;
+    }
+    first[i] = (top > 0) ? (size_t) top / n_rows : 0;
+    last[i] = MIN ((size_t) bottom / n_rows, n_stripes - 1);
+    for (size_t k = first[i]; k <= last[i]; k++) start[k+1]++;
+  }
+  for (size_t k = 0; k < n_stripes; k++) start[k+1] += start[k];
+
+  size_t *lines = g_new (size_t, MAX (start[n_stripes], 1));
+  size_t *fill = g_new (size_t, MAX (n_stripes, 1));
+  memcpy (fill, start, n_stripes * sizeof (size_t));
+  for (size_t i = 0; i < batch->n_lines; i++) {
+    for (size_t k = first[i]; k <= last[i]; k++) lines[fill[k]++] = i;
+  }
+
+  g_free (fill);
+  g_free (first);
+  g_free (last);
+  *stripe_start = start;
+  return lines;
+}
+
+static void
+export_ridge_lines_striped (const ChangeMapBatch *batch, OutputOptions *cfg)
+{
+  size_t n_rows = stripe_rows (cfg);
+  size_t n_stripes = (cfg->height + n_rows - 1) / n_rows;
+
+  size_t *stripe_start;
+  size_t *lines = ridge_lines_bucket (batch, cfg->origin_row, cfg->height,
+                                      n_rows, &stripe_start);
+  uint16_t *bins = NULL;
+  if (cfg->colour_bins > 0) {
+    bins = colour_bins_new (batch, cfg->palette, cfg->colour_bins);
+  }
+
+  uint32_t *buf = g_new (uint32_t, n_rows * cfg->width);
+  PngWriter *writer = png_writer_open (cfg->filename, cfg->width, cfg->height);
+
+  for (size_t k = 0; k < n_stripes; k++) {
+    size_t first_row = k * n_rows;
+    size_t rows = MIN (n_rows, cfg->height - first_row);
+
+    for (size_t c0 = 0; c0 < cfg->width; c0 += CAIRO_MAX_SIZE) {
+      size_t cols = MIN (CAIRO_MAX_SIZE, cfg->width - c0);
+      cairo_surface_t *surface =
+        cairo_image_surface_create_for_data ((unsigned char *) (buf + c0),
+                                             CAIRO_FORMAT_RGB24, cols, rows,
+                                             4 * cfg->width);
+      cairo_t *cr = cairo_create (surface);
+      cairo_translate (cr, -(double) c0, -(double) first_row);
+
+      draw_ridge_lines (cr, batch, cfg, bins, lines + stripe_start[k],
+                        stripe_start[k+1] - stripe_start[k]);
+
+      cairo_destroy (cr);
+      cairo_surface_flush (surface);
+      cairo_status_t status = cairo_surface_status (surface);
+      if (status != CAIRO_STATUS_SUCCESS) {
+        fprintf (stderr, "ERROR: %s.\n", cairo_status_to_string (status));
+        exit (4);
+      }
+      cairo_surface_destroy (surface);
+    }
+
+    png_writer_write_rows (writer, buf, cfg->width, rows);
+  }
+
+  png_writer_close (writer);
+  g_free (buf);
+  g_free (bins);
+  g_free (lines);
+  g_free (stripe_start);
+}
+
+static void
+export_ridge_mask_striped (const ChangeMapBatch *batch, OutputOptions *cfg)
 {
-  *x = l->coords[1][idx] / 128.0;
-  *y = l->coords[0][idx] / 128.0;
+  size_t n_rows = stripe_rows (cfg);
+  size_t n_stripes = (cfg->height + n_rows - 1) / n_rows;
+
+  size_t *stripe_start;
+  RidgePixel *pixels = ridge_pixels_bucket (batch, cfg->origin_row,
+                                            cfg->origin_col,
+                                            cfg->height, cfg->width,
+                                            n_rows, &stripe_start);
+
+  uint32_t *buf = g_new (uint32_t, n_rows * cfg->width);
+  PngWriter *writer = png_writer_open (cfg->filename, cfg->width, cfg->height);
+
+  for (size_t k = 0; k < n_stripes; k++) {
+    size_t first_row = k * n_rows;
+    size_t rows = MIN (n_rows, cfg->height - first_row);
+
+    for (size_t i = 0; i < rows * cfg->width; i++) {
+      buf[i] = cfg->palette->background;
+    }
+    for (size_t i = stripe_start[k]; i < stripe_start[k+1]; i++) {
+      buf[(pixels[i].row - first_row) * cfg->width + pixels[i].col] =
+        palette_lookup (cfg->palette, pixels[i].change);
+    }
+
+    png_writer_write_rows (writer, buf, cfg->width, rows);
+  }
+
+  png_writer_close (writer);
+  g_free (buf);
+  g_free (pixels);
+  g_free (stripe_start);
 }
 
 /* ---------------------------------------------------------------- */
 
 void
-export_ridge_lines (ChangeMap *map, OutputOptions *cfg)
+export_ridge_lines (const ChangeMapBatch *batch, OutputOptions *cfg)
 {
   cairo_surface_t *surface;
   cairo_status_t status;
 
-  g_assert (map);
+  g_assert (batch);
   g_assert (cfg);
+  g_assert (cfg->palette);
+
+  /* Vector formats are written without cairo */
+  if (cfg->format == FORMAT_SVG || cfg->format == FORMAT_GEOJSON) {
+    export_ridge_lines_vector (batch, cfg);
+    return;
+  }
+  if (use_stripes (cfg)) {
+    export_ridge_lines_striped (batch, cfg);
+    return;
+  }
 
   /* Create output surface */
   switch (cfg->format) {
@@ -128,33 +408,15 @@ export_ridge_lines (ChangeMap *map, OutputOptions *cfg)
   }
 
   /* Draw */
-  cairo_t *cr = cairo_create (surface);
-  cairo_set_line_width (cr, 1);
-  cairo_set_line_cap (cr, CAIRO_LINE_CAP_ROUND);
-
-  set_background_colour (cr);
-  cairo_paint (cr);
-
-  int N = rio_data_get_num_entries (map->ridges);
-
-  for (int i = 0; i < N; i++) {
-    ChangeMapLine *l = change_map_get_line (map, i);
-    for (int j = 0; j < l->n_segments; j++) {
-      double x, y;
-
-      set_damage_colour (cr, l->change[j]);
-
-      convert_coords (l, j, &x, &y);
-      cairo_move_to (cr, x, y);
-      convert_coords (l, j+1, &x, &y);
-      cairo_line_to (cr, x, y);
-
-      cairo_stroke (cr);
-    }
-    change_map_line_free (l);
+  uint16_t *bins = NULL;
+  if (cfg->colour_bins > 0) {
+    bins = colour_bins_new (batch, cfg->palette, cfg->colour_bins);
   }
 
+  cairo_t *cr = cairo_create (surface);
+  draw_ridge_lines (cr, batch, cfg, bins, NULL, batch->n_lines);
   cairo_destroy (cr);
+  g_free (bins);
 
   /* Complete output */
   status = cairo_surface_status (surface);
@@ -185,14 +447,30 @@ export_ridge_lines (ChangeMap *map, OutputOptions *cfg)
 }
 
 void
-export_ridge_mask (ChangeMap *map, OutputOptions *cfg) {
+export_ridge_mask (const ChangeMapBatch *batch, OutputOptions *cfg) {
 
   cairo_surface_t *surface;
   cairo_status_t status;
 
-  g_assert (map);
+  g_assert (batch);
   g_assert (cfg);
 
+  /* Raw change values are written without cairo */
+  if (cfg->format == FORMAT_TIFF) {
+    export_ridge_mask_tiff (batch, cfg);
+    return;
+  }
+  g_assert (cfg->palette);
+  if (use_stripes (cfg)) {
+    export_ridge_mask_striped (batch, cfg);
+    return;
+  }
+  if (cfg->width > CAIRO_MAX_SIZE || cfg->height > CAIRO_MAX_SIZE) {
+    fprintf (stderr, "ERROR: Image is too large for ridge mask output to '%s'.\n",
+             cfg->filename);
+    exit (4);
+  }
+
   /* Create image surface */
   surface = cairo_image_surface_create (CAIRO_FORMAT_RGB24,
                                         cfg->width, cfg->height);
@@ -200,45 +478,42 @@ export_ridge_mask (ChangeMap *map, OutputOptions *cfg) {
   int stride = cairo_image_surface_get_stride (surface);
   g_assert (s_data != NULL);
 
-  /* Draw */
-  cairo_t *cr = cairo_create (surface);
-
-  set_background_colour (cr);
-  cairo_paint (cr);
-
+  /* Draw directly into the image buffer.  Pixel values are built as
+   * 32-bit values to avoid endianness issues, and written with
+   * memcpy() to avoid strict aliasing issues. */
+  const Palette *palette = cfg->palette;
   cairo_surface_flush (surface);
 
-  int N = rio_data_get_num_entries (map->ridges);
-  for (int i = 0; i < N; i++) {
-    ChangeMapLine *l = change_map_get_line (map, i);
-    for (int j = 0; j < l->n_segments; j++) {
-      cairo_pattern_t *pattern;
-      double r, g, b;
-      int row, col;
-
-      change_map_line_get_pixel (l, j, &row, &col);
-
-      /* hack hack hack */
-      set_damage_colour (cr, l->change[j]);
-      pattern = cairo_get_source (cr);
-      cairo_pattern_get_rgba (pattern, &r, &g, &b, NULL);
+  for (size_t row = 0; row < cfg->height; row++) {
+    uint8_t *p = s_data + stride * row;
+    for (size_t col = 0; col < cfg->width; col++) {
+      memcpy (p + 4 * col, &palette->background, 4);
+    }
+  }
 
-      /* Directly set pixel value. Build 32-bit value to avoid
-       * endianness issues. Use memcpy() to avoid strict aliasing
-       * issues. */
-      int v = (((int) (r * 255) << 16) +
-               ((int) (g * 255) << 8) +
-               ((int) (b * 255)));
+  for (size_t i = 0; i < batch->n_lines; i++) {
+    size_t n_segments = batch->offsets[i+1] - batch->offsets[i];
+    const float *change = batch->change + batch->offsets[i];
+    for (size_t j = 0; j < n_segments; j++) {
+      int row, col;
+      change_map_batch_get_pixel (batch, i, j, &row, &col);
+      row -= cfg->origin_row;
+      col -= cfg->origin_col;
+      if (row < 0 || row >= cfg->height || col < 0 || col >= cfg->width) {
+        continue;
+      }
+
+      uint32_t v = palette_lookup (palette, change[j]);
       size_t offset = stride * row + 4 * col;
       memcpy (s_data + offset, &v, 4);
     }
-    change_map_line_free (l);
   }
 
-  cairo_destroy (cr);
+  cairo_surface_mark_dirty (surface);
 
   /* Create output file */
   cairo_surface_t *pdf_surface;
+  cairo_t *cr;
 
   switch (cfg->format) {
   case FORMAT_PNG:
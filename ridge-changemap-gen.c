@@ -0,0 +1,287 @@
+/*
+ * Surrey Space Centre urban change detection tool for SAR
+ * Copyright (C) 2013 Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include <glib.h>
+#include <tiffio.h>
+#include <ridgeio.h>
+
+/* Generates synthetic input data for ridge-changemap: a classified
+ * ridge data file, and a pair of coregistered 32-bit float TIFF
+ * images.  The images contain speckle with the statistics of
+ * single-look SAR amplitude, and the post-event image is darkened in
+ * a number of rectangular "damaged" patches.  The ridge lines are
+ * smooth random walks.  The same seed always gives the same data. */
+
+#define DEFAULT_DENSITY 1000 /* Lines per megapixel */
+#define DEFAULT_NAN_FRACTION 0.001
+#define DEFAULT_SEED 1
+
+#define GEN_MAX_LINE_POINTS 64
+#define GEN_N_PATCHES 32
+#define GEN_PATCH_ATTENUATION 0.5
+#define GEN_STRIP_ROWS 64
+
+#define GETOPT_OPTIONS "d:hi:s:"
+
+struct option long_options[] =
+  {
+    {"density", 1, 0, 'd'},
+    {"help", 0, 0, 'h'},
+    {"nan", 1, 0, 'i'},
+    {"seed", 1, 0, 's'},
+    {0, 0, 0, 0} /* Guard */
+  };
+
+static void
+usage (char *name, int status)
+{
+  printf (
+"Usage: %s [OPTION ...] ROWS COLS CRDG PRE POST\n"
+"\n"
+"Options:\n"
+"  -d, --density=N Generate N ridge lines per megapixel [%i]\n"
+"  -i, --nan=FRAC  Make a fraction FRAC of image pixels NaN [%g]\n"
+"  -s, --seed=N    Seed the random number generator with N [%i]\n"
+"  -h, --help      Display this message and exit\n"
+"\n"
+"Generates a synthetic classified ridge data file CRDG, and pre- and\n"
+"post-event images PRE and POST, for an image of ROWS x COLS pixels.\n"
+"The output can be used to test and benchmark ridge-changemap.\n"
+"\n"
+"Please report bugs to %s.\n",
+name, DEFAULT_DENSITY, DEFAULT_NAN_FRACTION, DEFAULT_SEED,
+PACKAGE_BUGREPORT);
+  exit (status);
+}
+
+/* -------------------------------------------------------------------------- */
+
+typedef struct _Patch Patch;
+struct _Patch {
+  uint32_t row, col, height, width;
+};
+
+/* Generate n_lines random ridge lines.  Each line is a random walk
+ * with unit steps and a slowly-varying heading, kept inside the
+ * image.  About half of the lines are labelled as class 1, and the
+ * rest as classes 2 and 3. */
+static RioData *
+gen_ridges (GRand *rand, uint32_t rows, uint32_t cols, size_t n_lines)
+{
+  RioData *data = rio_data_new (RIO_DATA_LINES);
+  rio_data_set_metadata_uint32 (data, RIO_KEY_IMAGE_ROWS, rows);
+  rio_data_set_metadata_uint32 (data, RIO_KEY_IMAGE_COLS, cols);
+
+  char *classification = g_new (char, MAX (n_lines, 1));
+  for (size_t i = 0; i < n_lines; i++) {
+    RioLine *line = rio_data_new_line (data);
+    int n_points = g_rand_int_range (rand, 2, GEN_MAX_LINE_POINTS + 1);
+    double row = g_rand_double_range (rand, 0, rows - 1);
+    double col = g_rand_double_range (rand, 0, cols - 1);
+    double heading = g_rand_double_range (rand, 0, 2 * G_PI);
+
+    for (int j = 0; j < n_points; j++) {
+      RioPoint *p = rio_line_new_point (line);
+      p->row = (uint32_t) (row * 128);
+      p->col = (uint32_t) (col * 128);
+
+      heading += g_rand_double_range (rand, -0.3, 0.3);
+      row = CLAMP (row + sin (heading), 0, rows - 1);
+      col = CLAMP (col + cos (heading), 0, cols - 1);
+    }
+
+    int r = g_rand_int_range (rand, 0, 4);
+    classification[i] = (r < 2) ? 1 : r;
+  }
+  rio_data_set_metadata (data, RIO_KEY_IMAGE_CLASSIFICATION,
+                         classification, n_lines);
+  g_free (classification);
+  return data;
+}
+
+/* Draw a single-look amplitude speckle sample with unit mean
+ * intensity. */
+static float
+gen_speckle (GRand *rand)
+{
+  return sqrtf (-logf (1 - (float) g_rand_double (rand)));
+}
+
+/* Write a rows x cols float TIFF to filename, one strip at a time.
+ * If patches is non-NULL, pixels inside the n_patches patches are
+ * attenuated.  Returns FALSE on failure. */
+static int
+gen_image (GRand *rand, const char *filename, uint32_t rows, uint32_t cols,
+           double nan_fraction, const Patch *patches, int n_patches)
+{
+  TIFF *tiff = TIFFOpen (filename, "w");
+  if (tiff == NULL) return FALSE;
+
+  TIFFSetField (tiff, TIFFTAG_IMAGEWIDTH, cols);
+  TIFFSetField (tiff, TIFFTAG_IMAGELENGTH, rows);
+  TIFFSetField (tiff, TIFFTAG_BITSPERSAMPLE, 32);
+  TIFFSetField (tiff, TIFFTAG_SAMPLESPERPIXEL, 1);
+  TIFFSetField (tiff, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
+  TIFFSetField (tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+  TIFFSetField (tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+  TIFFSetField (tiff, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+  TIFFSetField (tiff, TIFFTAG_ROWSPERSTRIP, GEN_STRIP_ROWS);
+
+  int status = TRUE;
+  float *strip = g_new (float, (size_t) GEN_STRIP_ROWS * cols);
+  for (uint32_t first_row = 0; status && first_row < rows;
+       first_row += GEN_STRIP_ROWS) {
+    uint32_t n_rows = MIN (GEN_STRIP_ROWS, rows - first_row);
+    for (uint32_t i = 0; i < n_rows; i++) {
+      for (uint32_t j = 0; j < cols; j++) {
+        float v = 100 * gen_speckle (rand);
+        if (g_rand_double (rand) < nan_fraction) v = NAN;
+        strip[(size_t) i * cols + j] = v;
+      }
+    }
+    for (int k = 0; k < n_patches; k++) {
+      const Patch *p = &patches[k];
+      uint32_t r0 = MAX (p->row, first_row);
+      uint32_t r1 = MIN (p->row + p->height, first_row + n_rows);
+      for (uint32_t r = r0; r < r1; r++) {
+        for (uint32_t c = p->col; c < p->col + p->width; c++) {
+          strip[(size_t) (r - first_row) * cols + c] *= GEN_PATCH_ATTENUATION;
+        }
+      }
+    }
+    tstrip_t s = first_row / GEN_STRIP_ROWS;
+    status = (TIFFWriteEncodedStrip (tiff, s, strip,
+                                     (size_t) n_rows * cols * sizeof (float))
+              >= 0);
+  }
+  g_free (strip);
+  TIFFClose (tiff);
+  return status;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int
+main (int argc, char **argv)
+{
+  int c, status;
+  int cfg_density = DEFAULT_DENSITY;
+  double cfg_nan = DEFAULT_NAN_FRACTION;
+  unsigned int cfg_seed = DEFAULT_SEED;
+  uint32_t rows, cols;
+
+  while (1) {
+    c = getopt_long (argc, argv, GETOPT_OPTIONS, long_options, NULL);
+    if (c == -1) break;
+
+    switch (c) {
+    case 'd':
+      status = sscanf (optarg, "%i", &cfg_density);
+      if (status != 1 || cfg_density < 0) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to -d option.\n\n",
+                 optarg);
+        usage (argv[0], 1);
+      }
+      break;
+    case 'h':
+      usage (argv[0], 0);
+      break;
+    case 'i':
+      status = sscanf (optarg, "%lf", &cfg_nan);
+      if (status != 1 || !(cfg_nan >= 0 && cfg_nan <= 1)) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to -i option.\n\n",
+                 optarg);
+        usage (argv[0], 1);
+      }
+      break;
+    case 's':
+      status = sscanf (optarg, "%u", &cfg_seed);
+      if (status != 1) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to -s option.\n\n",
+                 optarg);
+        usage (argv[0], 1);
+      }
+      break;
+
+    case '?':
+      usage (argv[0], 1);
+    default:
+      g_assert_not_reached ();
+    }
+  }
+
+  if (argc - optind != 5) {
+    fprintf (stderr,
+             "ERROR: You must specify an image size, and ridge data, pre-event\n"
+             "and post-event output filenames.\n\n");
+    usage (argv[0], 1);
+  }
+  if (sscanf (argv[optind], "%u", &rows) != 1 || rows == 0
+      || sscanf (argv[optind+1], "%u", &cols) != 1 || cols == 0) {
+    fprintf (stderr, "ERROR: Bad image size '%s x %s'.\n\n",
+             argv[optind], argv[optind+1]);
+    usage (argv[0], 1);
+  }
+  const char *crdg_fn = argv[optind+2];
+  const char *pre_fn = argv[optind+3];
+  const char *post_fn = argv[optind+4];
+
+  GRand *rand = g_rand_new_with_seed (cfg_seed);
+
+  /* Ridge data */
+  size_t n_lines = (size_t) ((double) rows * cols * cfg_density / 1e6);
+  RioData *ridges = gen_ridges (rand, rows, cols, n_lines);
+  if (!rio_data_to_file (ridges, crdg_fn)) {
+    fprintf (stderr, "ERROR: Could not write to '%s': %s.\n", crdg_fn,
+             strerror (errno));
+    exit (4);
+  }
+  rio_data_destroy (ridges);
+
+  /* Damaged patches, each up to 1/8 of the image size */
+  Patch patches[GEN_N_PATCHES];
+  for (int k = 0; k < GEN_N_PATCHES; k++) {
+    patches[k].height = g_rand_int_range (rand, 1, MAX (rows / 8, 1) + 1);
+    patches[k].width = g_rand_int_range (rand, 1, MAX (cols / 8, 1) + 1);
+    patches[k].row = g_rand_int_range (rand, 0, rows - patches[k].height + 1);
+    patches[k].col = g_rand_int_range (rand, 0, cols - patches[k].width + 1);
+  }
+
+  /* Images */
+  if (!gen_image (rand, pre_fn, rows, cols, cfg_nan, NULL, 0)) {
+    fprintf (stderr, "ERROR: Could not write to '%s'.\n", pre_fn);
+    exit (4);
+  }
+  if (!gen_image (rand, post_fn, rows, cols, cfg_nan,
+                  patches, GEN_N_PATCHES)) {
+    fprintf (stderr, "ERROR: Could not write to '%s'.\n", post_fn);
+    exit (4);
+  }
+
+  g_rand_free (rand);
+  return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * Surrey Space Centre urban change detection tool for SAR
+ * Copyright (C) 2013 Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <tiffio.h>
+
+#include <ridgeio.h>
+#include <ridgeutil.h>
+
+#include "ridge-changemap.h"
+
+/* Most input images are uncompressed, single-channel float TIFFs with
+ * their strips stored one after another.  In that case the pixel data
+ * in the file already has the layout of a RutSurface, so rather than
+ * decoding it into a new buffer, the file is mapped into memory and a
+ * RutSurface is pointed at it.  Mapped surfaces are read-only.
+ *
+ * Mapped surfaces must be released with image_destroy(), so a list
+ * of them is kept to tell them apart from decoded surfaces. */
+
+typedef struct _MappedImage MappedImage;
+struct _MappedImage {
+  RutSurface surface;
+  void *base;
+  size_t length;
+};
+
+static GMutex mapped_lock;
+static GSList *mapped_images = NULL;
+
+/* Check whether the image data in tiff is stored as a single
+ * contiguous, aligned, native-endian float array.  If so, set
+ * *offset to its position in the file. */
+static int
+image_tiff_is_mappable (TIFF *tiff, uint32_t rows, uint32_t cols,
+                        toff_t *offset)
+{
+  uint16_t bits, samples, format, compression;
+  toff_t *offsets, *counts;
+
+  if (!(TIFFGetFieldDefaulted (tiff, TIFFTAG_BITSPERSAMPLE, &bits)
+        && TIFFGetFieldDefaulted (tiff, TIFFTAG_SAMPLESPERPIXEL, &samples)
+        && TIFFGetFieldDefaulted (tiff, TIFFTAG_SAMPLEFORMAT, &format)
+        && TIFFGetFieldDefaulted (tiff, TIFFTAG_COMPRESSION, &compression)
+        && TIFFGetField (tiff, TIFFTAG_STRIPOFFSETS, &offsets)
+        && TIFFGetField (tiff, TIFFTAG_STRIPBYTECOUNTS, &counts))) {
+    return FALSE;
+  }
+  if (bits != 32 || samples != 1 || format != SAMPLEFORMAT_IEEEFP
+      || compression != COMPRESSION_NONE || TIFFIsTiled (tiff)
+      || TIFFIsByteSwapped (tiff)) {
+    return FALSE;
+  }
+
+  /* Strips must follow on from each other, and cover the image */
+  uint32_t n_strips = TIFFNumberOfStrips (tiff);
+  toff_t total = 0;
+  for (uint32_t i = 0; i < n_strips; i++) {
+    if (offsets[i] != offsets[0] + total) return FALSE;
+    total += counts[i];
+  }
+  if (total < (toff_t) rows * cols * sizeof (float)) return FALSE;
+  if (offsets[0] % sizeof (float) != 0) return FALSE;
+
+  *offset = offsets[0];
+  return TRUE;
+}
+
+/* ================================================================
+ * API functions
+ * ================================================================ */
+
+/* Read the size of a TIFF image without loading its pixel data. */
+int
+image_get_tiff_size (const char *filename, uint32_t *rows, uint32_t *cols)
+{
+  TIFF *tiff = TIFFOpen (filename, "r");
+  if (tiff == NULL) return FALSE;
+  int status = (TIFFGetField (tiff, TIFFTAG_IMAGELENGTH, rows)
+                && TIFFGetField (tiff, TIFFTAG_IMAGEWIDTH, cols));
+  TIFFClose (tiff);
+  return status;
+}
+
+/* Map an image into memory.  Returns NULL if the file isn't in a
+ * suitable format. */
+RutSurface *
+image_map_tiff (const char *filename)
+{
+  uint32_t rows, cols;
+  toff_t offset;
+
+  TIFF *tiff = TIFFOpen (filename, "r");
+  if (tiff == NULL) return NULL;
+  int status = (TIFFGetField (tiff, TIFFTAG_IMAGELENGTH, &rows)
+                && TIFFGetField (tiff, TIFFTAG_IMAGEWIDTH, &cols)
+                && image_tiff_is_mappable (tiff, rows, cols, &offset));
+  TIFFClose (tiff);
+  if (!status) return NULL;
+
+  int fd = open (filename, O_RDONLY);
+  if (fd < 0) return NULL;
+  struct stat st;
+  if (fstat (fd, &st) != 0
+      || (size_t) st.st_size < offset + (size_t) rows * cols * sizeof (float)) {
+    close (fd);
+    return NULL;
+  }
+  void *base = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (base == MAP_FAILED) return NULL;
+
+  MappedImage *img = g_new0 (MappedImage, 1);
+  img->base = base;
+  img->length = st.st_size;
+  img->surface.rows = rows;
+  img->surface.cols = cols;
+  img->surface.stride = cols;
+  img->surface.data = (float *) ((char *) base + offset);
+
+  g_mutex_lock (&mapped_lock);
+  mapped_images = g_slist_prepend (mapped_images, img);
+  g_mutex_unlock (&mapped_lock);
+
+  return &img->surface;
+}
+
+/* Load an image, mapping it into memory if possible and otherwise
+ * decoding it with rut_surface_from_tiff(). */
+RutSurface *
+image_load_tiff (const char *filename)
+{
+  RutSurface *result = image_map_tiff (filename);
+  if (result == NULL) result = rut_surface_from_tiff (filename);
+  return result;
+}
+
+void
+image_destroy (RutSurface *surface)
+{
+  if (!surface) return;
+
+  /* The surface is the first member of MappedImage */
+  MappedImage *img = (MappedImage *) surface;
+  g_mutex_lock (&mapped_lock);
+  GSList *link = g_slist_find (mapped_images, img);
+  if (link != NULL) mapped_images = g_slist_delete_link (mapped_images, link);
+  g_mutex_unlock (&mapped_lock);
+
+  if (link == NULL) {
+    rut_surface_destroy (surface);
+    return;
+  }
+  munmap (img->base, img->length);
+  g_free (img);
+}
@@ -0,0 +1,183 @@
+/*
+ * Surrey Space Centre urban change detection tool for SAR
+ * Copyright (C) 2013 Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include <ridgeio.h>
+#include <ridgeutil.h>
+
+#include "ridge-changemap.h"
+
+/* The ridge index is a uniform grid of square cells over the image.
+ * Each cell lists the ridge lines whose bounding boxes overlap it, in
+ * a single array ordered by cell (built with a counting sort).  A
+ * window query visits the cells that overlap the window, and reports
+ * each line whose bounding box overlaps the window from the first of
+ * those cells that it appears in, so that no line is reported
+ * twice. */
+
+#define INDEX_CELL_BITS 8
+
+typedef struct _LineBox LineBox;
+struct _LineBox {
+  uint32_t row0, col0, row1, col1; /* Inclusive, in pixels */
+};
+
+struct _RidgeIndex {
+  size_t n_lines;
+  LineBox *boxes;
+
+  size_t grid_rows, grid_cols;
+  size_t *cell_start; /* Array of length grid_rows*grid_cols+1 */
+  uint32_t *cell_lines;
+};
+
+static int
+uint32_compare (const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+  return (x > y) - (x < y);
+}
+
+/* ================================================================
+ * API functions
+ * ================================================================ */
+
+/* Build an index over all of the lines in ridges, which must be for
+ * an image of height x width pixels. */
+RidgeIndex *
+ridge_index_new (RioData *ridges, uint32_t height, uint32_t width)
+{
+  g_assert (ridges);
+
+  RidgeIndex *index = g_new0 (RidgeIndex, 1);
+  index->n_lines = rio_data_get_num_entries (ridges);
+  index->boxes = g_new (LineBox, MAX (index->n_lines, 1));
+  index->grid_rows = (MAX (height, 1) + (1 << INDEX_CELL_BITS) - 1) >> INDEX_CELL_BITS;
+  index->grid_cols = (MAX (width, 1) + (1 << INDEX_CELL_BITS) - 1) >> INDEX_CELL_BITS;
+
+  /* Find bounding boxes, clipped to the grid */
+  for (size_t i = 0; i < index->n_lines; i++) {
+    RioLine *line = rio_data_get_line (ridges, i);
+    int Np = rio_line_get_length (line);
+    LineBox *box = &index->boxes[i];
+    box->row0 = box->col0 = G_MAXUINT32;
+    box->row1 = box->col1 = 0;
+    for (int j = 0; j < Np; j++) {
+      RioPoint *p = rio_line_get_point (line, j);
+      uint32_t row = p->row >> 7, col = p->col >> 7;
+      box->row0 = MIN (box->row0, row);
+      box->col0 = MIN (box->col0, col);
+      box->row1 = MAX (box->row1, row);
+      box->col1 = MAX (box->col1, col);
+    }
+    box->row1 = MIN (box->row1, (index->grid_rows << INDEX_CELL_BITS) - 1);
+    box->col1 = MIN (box->col1, (index->grid_cols << INDEX_CELL_BITS) - 1);
+  }
+
+  /* Bucket lines by cell */
+  size_t n_cells = index->grid_rows * index->grid_cols;
+  index->cell_start = g_new0 (size_t, n_cells + 1);
+  for (size_t i = 0; i < index->n_lines; i++) {
+    LineBox *box = &index->boxes[i];
+    if (box->row0 > box->row1 || box->col0 > box->col1) continue;
+    for (size_t r = box->row0 >> INDEX_CELL_BITS; r <= box->row1 >> INDEX_CELL_BITS; r++) {
+      for (size_t c = box->col0 >> INDEX_CELL_BITS; c <= box->col1 >> INDEX_CELL_BITS; c++) {
+        index->cell_start[r * index->grid_cols + c + 1]++;
+      }
+    }
+  }
+  for (size_t k = 0; k < n_cells; k++) {
+    index->cell_start[k+1] += index->cell_start[k];
+  }
+
+  index->cell_lines = g_new (uint32_t, MAX (index->cell_start[n_cells], 1));
+  size_t *fill = g_new (size_t, n_cells);
+  memcpy (fill, index->cell_start, n_cells * sizeof (size_t));
+  for (size_t i = 0; i < index->n_lines; i++) {
+    LineBox *box = &index->boxes[i];
+    if (box->row0 > box->row1 || box->col0 > box->col1) continue;
+    for (size_t r = box->row0 >> INDEX_CELL_BITS; r <= box->row1 >> INDEX_CELL_BITS; r++) {
+      for (size_t c = box->col0 >> INDEX_CELL_BITS; c <= box->col1 >> INDEX_CELL_BITS; c++) {
+        index->cell_lines[fill[r * index->grid_cols + c]++] = i;
+      }
+    }
+  }
+  g_free (fill);
+
+  return index;
+}
+
+void
+ridge_index_free (RidgeIndex *index)
+{
+  if (!index) return;
+  g_free (index->boxes);
+  g_free (index->cell_start);
+  g_free (index->cell_lines);
+  g_free (index);
+}
+
+/* Find the lines whose bounding boxes overlap the window of height x
+ * width pixels with its top left corner at (row, col).  Returns an
+ * array of line indices in increasing order, which should be freed
+ * with g_free(), and sets *n to its length. */
+uint32_t *
+ridge_index_query (const RidgeIndex *index, uint32_t row, uint32_t col,
+                   uint32_t height, uint32_t width, size_t *n)
+{
+  g_assert (index);
+  g_assert (n);
+
+  GArray *result = g_array_new (FALSE, FALSE, sizeof (uint32_t));
+  if (height == 0 || width == 0) goto done;
+
+  uint32_t row1 = row + height - 1, col1 = col + width - 1;
+  size_t cell_r0 = row >> INDEX_CELL_BITS, cell_c0 = col >> INDEX_CELL_BITS;
+  size_t cell_r1 = MIN (row1 >> INDEX_CELL_BITS, index->grid_rows - 1);
+  size_t cell_c1 = MIN (col1 >> INDEX_CELL_BITS, index->grid_cols - 1);
+
+  for (size_t r = cell_r0; r <= cell_r1; r++) {
+    for (size_t c = cell_c0; c <= cell_c1; c++) {
+      size_t k = r * index->grid_cols + c;
+      for (size_t j = index->cell_start[k]; j < index->cell_start[k+1]; j++) {
+        uint32_t i = index->cell_lines[j];
+        const LineBox *box = &index->boxes[i];
+        if (box->row1 < row || box->row0 > row1
+            || box->col1 < col || box->col0 > col1) continue;
+
+        /* Only report the line from the first cell in the window
+         * that it overlaps */
+        if (r != MAX (cell_r0, box->row0 >> INDEX_CELL_BITS)
+            || c != MAX (cell_c0, box->col0 >> INDEX_CELL_BITS)) continue;
+
+        g_array_append_val (result, i);
+      }
+    }
+  }
+
+ done:
+  qsort (result->data, result->len, sizeof (uint32_t), uint32_compare);
+  *n = result->len;
+  return (uint32_t *) g_array_free (result, FALSE);
+}
@@ -0,0 +1,342 @@
+/*
+ * Surrey Space Centre urban change detection tool for SAR
+ * Copyright (C) 2013 Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#include <glib.h>
+
+#include <ridgeio.h>
+#include <ridgeutil.h>
+
+#include "ridge-changemap.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define HAVE_X86_KERNELS 1
+#  include <immintrin.h>
+#endif
+
+/* All of the kernels below calculate the sum over a row of pixels of
+ * the square ratio ((1 + pre) / (1 + post))^2, with non-finite and
+ * zero inputs replaced by nan_val (this matches the isnormal() test
+ * in square_ratio(), because every non-zero finite float is a normal
+ * double).  Summation is carried out using Kahan sum, with the vector
+ * kernels keeping one compensated sum per lane.  The vector kernels
+ * therefore add up the row in a different order from the scalar
+ * kernel, but all three agree to within a relative error of 1e-12. */
+
+#define RATIO_EPSILON 1.0
+
+typedef double (*SquareRatioSumFunc) (const float *pre, const float *post,
+                                      int n, double nan_val);
+
+static double
+square_ratio_sum_scalar (const float *pre, const float *post,
+                         int n, double nan_val)
+{
+  double sum = 0;
+  double c = 0;
+  for (int i = 0; i < n; i++) {
+    double num = pre[i];
+    double den = post[i];
+    if (!isnormal (num)) num = nan_val;
+    if (!isnormal (den)) den = nan_val;
+    double r = (RATIO_EPSILON + num) / (RATIO_EPSILON + den);
+    r = r*r;
+
+    double y = r - c;
+    double t = sum + y;
+    c = (t - sum) - y;
+    sum = t;
+  }
+  return sum;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* Combine per-lane Kahan sums, followed by the scalar tail of the
+ * row. */
+static double
+square_ratio_sum_finish (const double *lane_sum, const double *lane_c,
+                         int n_lanes, const float *pre, const float *post,
+                         int n, double nan_val)
+{
+  double sum = 0;
+  double c = 0;
+  for (int i = 0; i < n_lanes; i++) {
+    double y = (lane_sum[i] - lane_c[i]) - c;
+    double t = sum + y;
+    c = (t - sum) - y;
+    sum = t;
+  }
+  double y = square_ratio_sum_scalar (pre, post, n, nan_val) - c;
+  return sum + y;
+}
+
+__attribute__((target("sse2")))
+static double
+square_ratio_sum_sse2 (const float *pre, const float *post,
+                       int n, double nan_val)
+{
+  const __m128d one = _mm_set1_pd (RATIO_EPSILON);
+  const __m128d zero = _mm_setzero_pd ();
+  const __m128d nanv = _mm_set1_pd (nan_val);
+  const __m128d maxv = _mm_set1_pd (DBL_MAX);
+  const __m128d absmask = _mm_castsi128_pd (_mm_set1_epi64x (INT64_MAX));
+  __m128d sum = _mm_setzero_pd ();
+  __m128d c = _mm_setzero_pd ();
+
+  int i;
+  for (i = 0; i + 2 <= n; i += 2) {
+    __m128d num = _mm_cvtps_pd (_mm_castpd_ps (_mm_load_sd ((const double *) (pre + i))));
+    __m128d den = _mm_cvtps_pd (_mm_castpd_ps (_mm_load_sd ((const double *) (post + i))));
+
+    /* Branch-free replacement of zero and non-finite values. */
+    __m128d ok_num = _mm_and_pd (_mm_cmpneq_pd (num, zero),
+                                 _mm_cmple_pd (_mm_and_pd (num, absmask), maxv));
+    __m128d ok_den = _mm_and_pd (_mm_cmpneq_pd (den, zero),
+                                 _mm_cmple_pd (_mm_and_pd (den, absmask), maxv));
+    /* cmpneq is true for NaN, but the magnitude test is not */
+    num = _mm_or_pd (_mm_and_pd (ok_num, num), _mm_andnot_pd (ok_num, nanv));
+    den = _mm_or_pd (_mm_and_pd (ok_den, den), _mm_andnot_pd (ok_den, nanv));
+
+    __m128d r = _mm_div_pd (_mm_add_pd (one, num), _mm_add_pd (one, den));
+    r = _mm_mul_pd (r, r);
+
+    __m128d y = _mm_sub_pd (r, c);
+    __m128d t = _mm_add_pd (sum, y);
+    c = _mm_sub_pd (_mm_sub_pd (t, sum), y);
+    sum = t;
+  }
+
+  double lane_sum[2], lane_c[2];
+  _mm_storeu_pd (lane_sum, sum);
+  _mm_storeu_pd (lane_c, c);
+  return square_ratio_sum_finish (lane_sum, lane_c, 2, pre + i, post + i,
+                                  n - i, nan_val);
+}
+
+__attribute__((target("avx2")))
+static double
+square_ratio_sum_avx2 (const float *pre, const float *post,
+                       int n, double nan_val)
+{
+  const __m256d one = _mm256_set1_pd (RATIO_EPSILON);
+  const __m256d zero = _mm256_setzero_pd ();
+  const __m256d nanv = _mm256_set1_pd (nan_val);
+  const __m256d maxv = _mm256_set1_pd (DBL_MAX);
+  const __m256d absmask = _mm256_castsi256_pd (_mm256_set1_epi64x (INT64_MAX));
+  __m256d sum[2] = { _mm256_setzero_pd (), _mm256_setzero_pd () };
+  __m256d c[2] = { _mm256_setzero_pd (), _mm256_setzero_pd () };
+
+  int i;
+  for (i = 0; i + 8 <= n; i += 8) {
+    for (int k = 0; k < 2; k++) {
+      __m256d num = _mm256_cvtps_pd (_mm_loadu_ps (pre + i + 4*k));
+      __m256d den = _mm256_cvtps_pd (_mm_loadu_ps (post + i + 4*k));
+
+      /* Branch-free replacement of zero and non-finite values.
+       * Ordered comparisons are false for NaN. */
+      __m256d ok_num =
+        _mm256_and_pd (_mm256_cmp_pd (num, zero, _CMP_NEQ_OQ),
+                       _mm256_cmp_pd (_mm256_and_pd (num, absmask), maxv,
+                                      _CMP_LE_OQ));
+      __m256d ok_den =
+        _mm256_and_pd (_mm256_cmp_pd (den, zero, _CMP_NEQ_OQ),
+                       _mm256_cmp_pd (_mm256_and_pd (den, absmask), maxv,
+                                      _CMP_LE_OQ));
+      num = _mm256_blendv_pd (nanv, num, ok_num);
+      den = _mm256_blendv_pd (nanv, den, ok_den);
+
+      __m256d r = _mm256_div_pd (_mm256_add_pd (one, num),
+                                 _mm256_add_pd (one, den));
+      r = _mm256_mul_pd (r, r);
+
+      __m256d y = _mm256_sub_pd (r, c[k]);
+      __m256d t = _mm256_add_pd (sum[k], y);
+      c[k] = _mm256_sub_pd (_mm256_sub_pd (t, sum[k]), y);
+      sum[k] = t;
+    }
+  }
+
+  double lane_sum[8], lane_c[8];
+  _mm256_storeu_pd (lane_sum, sum[0]);
+  _mm256_storeu_pd (lane_sum + 4, sum[1]);
+  _mm256_storeu_pd (lane_c, c[0]);
+  _mm256_storeu_pd (lane_c + 4, c[1]);
+  return square_ratio_sum_finish (lane_sum, lane_c, 8, pre + i, post + i,
+                                  n - i, nan_val);
+}
+
+#endif /* HAVE_X86_KERNELS */
+
+/* Square ratio histograms have logarithmically-spaced bins, found
+ * directly from the bits of the IEEE double: the bin index is the
+ * exponent followed by the top HISTOGRAM_MANTISSA_BITS bits of the
+ * mantissa.  Each bin is therefore 2^-8 (about 0.4%) wide relative
+ * to its lower edge.  Ratios below 2^HISTOGRAM_MIN_EXP are counted in
+ * the first bin, and larger ratios than the last bin covers (as well
+ * as infinite ratios) are counted in the last one. */
+
+#define HISTOGRAM_MANTISSA_BITS 8
+#define HISTOGRAM_MIN_EXP (-32)
+#define HISTOGRAM_N_EXP (KERNEL_HISTOGRAM_BINS >> HISTOGRAM_MANTISSA_BITS)
+
+static inline int
+histogram_bin (double r)
+{
+  uint64_t bits;
+  memcpy (&bits, &r, sizeof (bits));
+  int e = (int) ((bits >> 52) & 0x7ff) - 1023 - HISTOGRAM_MIN_EXP;
+  if (e < 0) return 0;
+  if (e >= HISTOGRAM_N_EXP) return KERNEL_HISTOGRAM_BINS - 1;
+  int m = (int) (bits >> (52 - HISTOGRAM_MANTISSA_BITS))
+    & ((1 << HISTOGRAM_MANTISSA_BITS) - 1);
+  return (e << HISTOGRAM_MANTISSA_BITS) | m;
+}
+
+/* Return the function for kernel, or NULL if it isn't compiled in or
+ * the CPU doesn't support it. */
+static SquareRatioSumFunc
+square_ratio_sum_get (int kernel)
+{
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init ();
+  if (kernel == KERNEL_AVX2 && __builtin_cpu_supports ("avx2")) {
+    return square_ratio_sum_avx2;
+  }
+  if (kernel == KERNEL_SSE2 && __builtin_cpu_supports ("sse2")) {
+    return square_ratio_sum_sse2;
+  }
+#endif
+  if (kernel == KERNEL_SCALAR) return square_ratio_sum_scalar;
+  return NULL;
+}
+
+/* Return the fastest kernel supported by the CPU. */
+static SquareRatioSumFunc
+square_ratio_sum_select (void)
+{
+  for (int k = KERNEL_N_KERNELS - 1; k >= 0; k--) {
+    SquareRatioSumFunc func = square_ratio_sum_get (k);
+    if (func != NULL) return func;
+  }
+  g_assert_not_reached ();
+}
+
+/* ================================================================
+ * API functions
+ * ================================================================ */
+
+/* Calculate the square ratio for a single pair of pixel values. */
+double
+kernel_square_ratio (double num, double den, double nan_val)
+{
+  if (!isnormal (num)) num = nan_val;
+  if (!isnormal (den)) den = nan_val;
+  double r = (RATIO_EPSILON + num) / (RATIO_EPSILON + den);
+  r = r*r; /* Square of ratio */
+  g_assert (isnormal (r));
+  g_assert (r > 0);
+  return r;
+}
+
+/* Calculate the compensated sum of square ratios over n pixels of
+ * the pre and post image rows, using the fastest kernel supported by
+ * the CPU. */
+double
+kernel_square_ratio_sum (const float *pre, const float *post,
+                         int n, double nan_val)
+{
+  static SquareRatioSumFunc func = NULL;
+  static gsize initialised = 0;
+  if (g_once_init_enter (&initialised)) {
+    func = square_ratio_sum_select ();
+    g_once_init_leave (&initialised, 1);
+  }
+  return func (pre, post, n, nan_val);
+}
+
+/* Return TRUE if kernel can be used on this CPU. */
+int
+kernel_square_ratio_sum_supported (int kernel)
+{
+  g_assert (kernel >= 0 && kernel < KERNEL_N_KERNELS);
+  return (square_ratio_sum_get (kernel) != NULL);
+}
+
+/* As kernel_square_ratio_sum(), but using the given kernel, which
+ * must be supported by the CPU. */
+double
+kernel_square_ratio_sum_with (int kernel, const float *pre,
+                              const float *post, int n, double nan_val)
+{
+  g_assert (kernel >= 0 && kernel < KERNEL_N_KERNELS);
+  SquareRatioSumFunc func = square_ratio_sum_get (kernel);
+  g_assert (func != NULL);
+  return func (pre, post, n, nan_val);
+}
+
+/* Add scale times the square ratio of each of n pixels of the pre
+ * and post image rows to the corresponding element of acc. */
+void
+kernel_square_ratio_accumulate (const float *pre, const float *post,
+                                int n, double nan_val, double scale,
+                                double *acc)
+{
+  for (int i = 0; i < n; i++) {
+    double num = pre[i];
+    double den = post[i];
+    if (!isnormal (num)) num = nan_val;
+    if (!isnormal (den)) den = nan_val;
+    double r = (RATIO_EPSILON + num) / (RATIO_EPSILON + den);
+    acc[i] += scale * (r*r);
+  }
+}
+
+/* Add the square ratios of n pixels of the pre and post image rows to
+ * the KERNEL_HISTOGRAM_BINS counts in hist. */
+void
+kernel_square_ratio_histogram (const float *pre, const float *post,
+                               int n, double nan_val, uint64_t *hist)
+{
+  for (int i = 0; i < n; i++) {
+    double num = pre[i];
+    double den = post[i];
+    if (!isnormal (num)) num = nan_val;
+    if (!isnormal (den)) den = nan_val;
+    double r = (RATIO_EPSILON + num) / (RATIO_EPSILON + den);
+    hist[histogram_bin (r*r)]++;
+  }
+}
+
+/* Return the lower edge of a histogram bin.  The upper edge of the
+ * last bin is kernel_histogram_bin_edge (KERNEL_HISTOGRAM_BINS). */
+double
+kernel_histogram_bin_edge (int bin)
+{
+  g_assert (bin >= 0 && bin <= KERNEL_HISTOGRAM_BINS);
+  int e = bin >> HISTOGRAM_MANTISSA_BITS;
+  int m = bin & ((1 << HISTOGRAM_MANTISSA_BITS) - 1);
+  return ldexp (1 + ldexp (m, -HISTOGRAM_MANTISSA_BITS),
+                e + HISTOGRAM_MIN_EXP);
+}
@@ -18,6 +18,7 @@
 
 #include "config.h"
 
+#include <string.h>
 #include <math.h>
 
 #include <glib.h>
@@ -27,7 +28,6 @@
 
 #include "ridge-changemap.h"
 
-#define RATIO_EPSILON 1.0
 #define NAN_VAL 0.0
 
 /* ================================================================
@@ -37,20 +37,86 @@
 static double
 square_ratio (ChangeMap *map, int row, int col)
 {
-  double num = RUT_SURFACE_REF (map->pre, row, col);
-  double den = RUT_SURFACE_REF (map->post, row, col);
-  if (!isnormal (num)) num = map->nan_val;
-  if (!isnormal (den)) den = map->nan_val;
-  double r = (RATIO_EPSILON + num) / (RATIO_EPSILON + den);
-  r = r*r; /* Square of ratio */
-  g_assert (isnormal (r));
-  g_assert (r > 0);
-  return r;
+  if (map->pre_compact) {
+    uint16_t pre = COMPACT_IMAGE_ROW (map->pre_compact, row)[col];
+    uint16_t post = COMPACT_IMAGE_ROW (map->post_compact, row)[col];
+    return kernel_square_ratio (compact_decode (pre), compact_decode (post),
+                                map->nan_val);
+  }
+  return kernel_square_ratio (RUT_SURFACE_REF (map->pre, row, col),
+                              RUT_SURFACE_REF (map->post, row, col),
+                              map->nan_val);
+}
+
+/* Add scale times the square ratio of each pixel in image row row to
+ * acc.  Rows of compact images are decoded into pre_buf and
+ * post_buf, which must have space for map->width values. */
+static void
+accumulate_row (ChangeMap *map, int row, double scale, double *acc,
+                float *pre_buf, float *post_buf)
+{
+  const float *pre_row, *post_row;
+  if (map->pre_compact) {
+    compact_decode_row (COMPACT_IMAGE_ROW (map->pre_compact, row),
+                        map->width, pre_buf);
+    compact_decode_row (COMPACT_IMAGE_ROW (map->post_compact, row),
+                        map->width, post_buf);
+    pre_row = pre_buf;
+    post_row = post_buf;
+  } else {
+    pre_row = &RUT_SURFACE_REF (map->pre, row, 0);
+    post_row = &RUT_SURFACE_REF (map->post, row, 0);
+  }
+  kernel_square_ratio_accumulate (pre_row, post_row, map->width,
+                                  map->nan_val, scale, acc);
+}
+
+static int
+has_images (ChangeMap *map)
+{
+  return ((map->pre && map->post)
+          || (map->pre_compact && map->post_compact));
+}
+
+static void
+clear_segment_changes (ChangeMap *map)
+{
+  g_free (map->segment_offsets);
+  g_free (map->segment_changes);
+  map->segment_offsets = NULL;
+  map->segment_changes = NULL;
+}
+
+static void
+recalibrate_compact (ChangeMap *map)
+{
+  const uint16_t **pre_rows = g_new (const uint16_t *, map->height);
+  const uint16_t **post_rows = g_new (const uint16_t *, map->height);
+  for (int i = 0; i < map->height; i++) {
+    pre_rows[i] = COMPACT_IMAGE_ROW (map->pre_compact, i);
+    post_rows[i] = COMPACT_IMAGE_ROW (map->post_compact, i);
+  }
+
+  Calibrator *cal = calibrator_new (map->height, map->width,
+                                    map->nan_val, map->threads);
+  calibrator_set_estimator (cal, map->estimator, map->estimator_param);
+  calibrator_add_compact_rows (cal, 0, map->height, pre_rows, post_rows);
+  map->calibration = calibrator_finish (cal);
+  calibrator_free (cal);
+
+  g_free (pre_rows);
+  g_free (post_rows);
+  g_assert (isnormal (map->calibration));
 }
 
 static void
 recalibrate (ChangeMap *map)
 {
+  if (map->pre_compact) {
+    recalibrate_compact (map);
+    return;
+  }
+
   if (!(map->pre && map->post)) {
     map->calibration = NAN;
   }
@@ -61,26 +127,461 @@ recalibrate (ChangeMap *map)
   g_assert (map->pre->cols  >= map->width);
   g_assert (map->post->cols >= map->width);
 
-  /* Calculate mean square ratio of pre and post images.  Summation is
-   * carried out using Kahan sum. In this case, condition number is 1
-   * because all values expected to be positive. */
-  double N = (double) map->height * (double) map->width;
-  double sum = 0;
-  double c = 0;
+  /* Calculate mean square ratio of pre and post images. */
+  const float **pre_rows = g_new (const float *, map->height);
+  const float **post_rows = g_new (const float *, map->height);
   for (int i = 0; i < map->height; i++) {
-    for (int j = 0; j < map->width; j++) {
-      double r = square_ratio (map, i, j);
-      double y = r - c;
-      double t = sum + y;
-      c = (t - sum) - y;
-      sum = t;
-    }
+    pre_rows[i] = &RUT_SURFACE_REF (map->pre, i, 0);
+    post_rows[i] = &RUT_SURFACE_REF (map->post, i, 0);
   }
 
-  map->calibration = sum / N;
+  Calibrator *cal = calibrator_new (map->height, map->width,
+                                    map->nan_val, map->threads);
+  calibrator_set_estimator (cal, map->estimator, map->estimator_param);
+  calibrator_add_rows (cal, 0, map->height, pre_rows, post_rows);
+  map->calibration = calibrator_finish (cal);
+  calibrator_free (cal);
+
+  g_free (pre_rows);
+  g_free (post_rows);
   g_assert (isnormal (map->calibration));
 }
 
+/* Copy the coordinates of line index into rows and cols, and return
+ * the number of points. */
+static int
+fill_line_coords (ChangeMap *map, int index, uint32_t *rows, uint32_t *cols)
+{
+  RioLine *ridgeline = change_map_get_ridge_line (map, index);
+  int Np = rio_line_get_length (ridgeline);
+
+  for (int i = 0; i < Np; i++) {
+    RioPoint *p = rio_line_get_point (ridgeline, i);
+    rows[i] = p->row;
+    cols[i] = p->col;
+  }
+  return Np;
+}
+
+/* Copy the coordinates of line index into rows and cols, and its
+ * change values into change.  The map must already be calibrated. */
+static void
+fill_line (ChangeMap *map, int index, uint32_t *rows, uint32_t *cols,
+           float *change)
+{
+  int Np = fill_line_coords (map, index, rows, cols);
+
+  /* Use precomputed change coefficients, if available */
+  if (map->segment_changes) {
+    g_assert (map->segment_offsets[index+1] - map->segment_offsets[index]
+              == Np - 1);
+    memcpy (change, map->segment_changes + map->segment_offsets[index],
+            (Np - 1) * sizeof (float));
+    return;
+  }
+
+  /* Calculate change coefficients */
+  for (int i = 0; i < Np - 1; i++) {
+    int row, col;
+    change_map_segment_pixel (rows[i], cols[i], rows[i+1], cols[i+1],
+                              &row, &col);
+    row -= map->origin_row;
+    col -= map->origin_col;
+
+    /* Segments that sample outside the window have no change value */
+    if (row < 0 || row >= map->height || col < 0 || col >= map->width) {
+      change[i] = NAN;
+      continue;
+    }
+
+    double r = square_ratio (map, row, col);
+    double d = 1 - map->calibration / r;
+    g_assert (isnormal (d));
+    change[i] = d;
+  }
+}
+
+/* Number of lines claimed at a time by change_map_compute_all()
+ * worker threads */
+#define COMPUTE_ALL_GRAIN 64
+
+/* Segment indices in a GatherEntry are 32 bits, relative to the
+ * first segment of the lines being gathered, so that an entry takes 8
+ * bytes.  Batches with more segments are gathered a chunk of lines at
+ * a time. */
+#define GATHER_MAX_SEGMENTS ((size_t) UINT32_MAX)
+
+typedef struct _GatherEntry GatherEntry;
+struct _GatherEntry {
+  uint32_t col;
+  uint32_t segment; /* Index into batch->change, from segment_base */
+};
+
+typedef struct _ComputeAllTask ComputeAllTask;
+struct _ComputeAllTask {
+  ChangeMap *map;
+  ChangeMapBatch *batch;
+
+  /* Lines being gathered, and the lines assigned to each thread when
+   * bucketing their sample pixels */
+  size_t line_start, line_end, segment_base;
+  size_t *thread_lines; /* Array of length n_threads+1 */
+  size_t *thread_rows;  /* Per-thread row counts, then fill positions */
+
+  /* Sample pixels, bucketed by row */
+  size_t *row_start; /* Array of length map->height+1 */
+  GatherEntry *entries;
+  volatile gint next_row;
+
+  /* Local calibration is carried out in bands of rows */
+  int band_rows, n_bands;
+  volatile gint next_band;
+};
+
+/* Copy the coordinates of each line, and any precomputed change
+ * values. */
+static void
+compute_all_range (size_t start, size_t end, void *user_data)
+{
+  ComputeAllTask *task = (ComputeAllTask *) user_data;
+  ChangeMapBatch *batch = task->batch;
+
+  for (size_t i = start; i < end; i++) {
+    size_t s = batch->offsets[i];
+    if (task->map->segment_changes) {
+      fill_line (task->map, i, batch->coords[0] + s + i,
+                 batch->coords[1] + s + i, batch->change + s);
+    } else {
+      fill_line_coords (task->map, i, batch->coords[0] + s + i,
+                        batch->coords[1] + s + i);
+    }
+  }
+}
+
+/* Find the pixel sampled by segment j (counted from the start of the
+ * batch) of line i, relative to the map's window.  Returns FALSE if it
+ * lies outside the window. */
+static int
+gather_pixel (ChangeMap *map, ChangeMapBatch *batch, size_t i, size_t j,
+              int *row, int *col)
+{
+  size_t p = j + i;
+  change_map_segment_pixel (batch->coords[0][p], batch->coords[1][p],
+                            batch->coords[0][p+1], batch->coords[1][p+1],
+                            row, col);
+  *row -= map->origin_row;
+  *col -= map->origin_col;
+  return (*row >= 0 && *row < map->height && *col >= 0 && *col < map->width);
+}
+
+/* Claim rows in turn, evaluate the change at each distinct sample
+ * pixel in the row, and scatter it to the segments that sample it.
+ * Pixels that have already been evaluated in the current row are
+ * found by stamping their columns with the row number. */
+static void
+gather_rows_thread (int thread, int n_threads, void *user_data)
+{
+  ComputeAllTask *task = (ComputeAllTask *) user_data;
+  ChangeMap *map = task->map;
+  float *change = task->batch->change + task->segment_base;
+
+  uint32_t *stamp = g_new0 (uint32_t, map->width); /* Row + 1 */
+  float *value = g_new (float, map->width);
+
+  while (1) {
+    int row = g_atomic_int_add (&task->next_row, 1);
+    if (row >= map->height) break;
+
+    for (size_t k = task->row_start[row]; k < task->row_start[row+1]; k++) {
+      const GatherEntry *e = &task->entries[k];
+      if (stamp[e->col] != row + 1) {
+        double r = square_ratio (map, row, e->col);
+        double d = 1 - map->calibration / r;
+        g_assert (isnormal (d));
+        value[e->col] = d;
+        stamp[e->col] = row + 1;
+      }
+      change[e->segment] = value[e->col];
+    }
+  }
+
+  g_free (stamp);
+  g_free (value);
+}
+
+/* With local calibration, each pixel is calibrated against the mean
+ * square ratio over the (2R+1) x (2R+1) window centred on it, clipped
+ * to the image, where R is map->local_radius.  The window means are
+ * found from a summed-area table of square ratios, but the whole
+ * table is never stored.  Instead, each thread claims a band of rows
+ * and keeps, for the current row, the sum of the square ratios in the
+ * window's rows for each column; this is updated by adding the row
+ * entering the window and subtracting the row leaving it.  The prefix
+ * sum of the column sums is the difference between the two rows of
+ * the summed-area table that bound the window, so the sum over any
+ * window centred on the row is found with a single subtraction.
+ *
+ * Each band starts by summing the 2R+1 rows around its first row, so
+ * bands are made at least 4R rows high to limit the extra work, and
+ * starting afresh for each band stops rounding error accumulating.
+ * Bands without any sample pixels are skipped.  Each thread needs two
+ * rows of width doubles. */
+#define LOCAL_BAND_ROWS 256
+
+static void
+gather_local_thread (int thread, int n_threads, void *user_data)
+{
+  ComputeAllTask *task = (ComputeAllTask *) user_data;
+  ChangeMap *map = task->map;
+  float *change = task->batch->change + task->segment_base;
+  float *calibrations = task->batch->calibrations;
+  int R = map->local_radius;
+  if (calibrations) calibrations += task->segment_base;
+
+  double *col_sum = g_new (double, map->width);
+  double *prefix = g_new (double, map->width + 1);
+  float *pre_buf = NULL, *post_buf = NULL;
+  if (map->pre_compact) {
+    pre_buf = g_new (float, map->width);
+    post_buf = g_new (float, map->width);
+  }
+
+  while (1) {
+    int band = g_atomic_int_add (&task->next_band, 1);
+    if (band >= task->n_bands) break;
+
+    int start = band * task->band_rows;
+    int end = MIN (start + task->band_rows, map->height);
+    if (task->row_start[start] == task->row_start[end]) continue;
+
+    /* Column sums for the window rows of the first row in the band */
+    memset (col_sum, 0, map->width * sizeof (double));
+    for (int i = MAX (start - R, 0); i < MIN (start + R + 1, map->height); i++) {
+      accumulate_row (map, i, 1, col_sum, pre_buf, post_buf);
+    }
+
+    for (int row = start; row < end; row++) {
+      if (row > start) {
+        int enter = row + R, leave = row - R - 1;
+        if (enter < map->height) {
+          accumulate_row (map, enter, 1, col_sum, pre_buf, post_buf);
+        }
+        if (leave >= 0) {
+          accumulate_row (map, leave, -1, col_sum, pre_buf, post_buf);
+        }
+      }
+      if (task->row_start[row] == task->row_start[row+1]) continue;
+
+      prefix[0] = 0;
+      for (int c = 0; c < map->width; c++) prefix[c+1] = prefix[c] + col_sum[c];
+      int n_rows = MIN (row + R + 1, map->height) - MAX (row - R, 0);
+
+      for (size_t k = task->row_start[row]; k < task->row_start[row+1]; k++) {
+        const GatherEntry *e = &task->entries[k];
+        int c0 = MAX ((int) e->col - R, 0);
+        int c1 = MIN ((int) e->col + R + 1, map->width);
+        double calibration = ((prefix[c1] - prefix[c0])
+                              / ((double) n_rows * (c1 - c0)));
+        double r = square_ratio (map, row, e->col);
+        double d = 1 - calibration / r;
+        g_assert (isfinite (d));
+        change[e->segment] = d;
+        if (calibrations) calibrations[e->segment] = calibration;
+      }
+    }
+  }
+
+  g_free (col_sum);
+  g_free (prefix);
+  g_free (pre_buf);
+  g_free (post_buf);
+}
+
+/* Count the sample pixels in each row for the lines assigned to a
+ * thread.  Segments that sample outside the window have no change
+ * value. */
+static void
+gather_count_thread (int thread, int n_threads, void *user_data)
+{
+  ComputeAllTask *task = (ComputeAllTask *) user_data;
+  ChangeMap *map = task->map;
+  ChangeMapBatch *batch = task->batch;
+  size_t *counts = task->thread_rows + (size_t) thread * map->height;
+
+  memset (counts, 0, map->height * sizeof (size_t));
+  for (size_t i = task->thread_lines[thread];
+       i < task->thread_lines[thread+1]; i++) {
+    for (size_t j = batch->offsets[i]; j < batch->offsets[i+1]; j++) {
+      int row, col;
+      if (gather_pixel (map, batch, i, j, &row, &col)) {
+        counts[row]++;
+      } else {
+        batch->change[j] = NAN;
+        if (batch->calibrations) batch->calibrations[j] = NAN;
+      }
+    }
+  }
+}
+
+/* Bucket the sample pixels for the lines assigned to a thread, using
+ * the thread's fill positions for each row. */
+static void
+gather_fill_thread (int thread, int n_threads, void *user_data)
+{
+  ComputeAllTask *task = (ComputeAllTask *) user_data;
+  ChangeMap *map = task->map;
+  ChangeMapBatch *batch = task->batch;
+  size_t *fill = task->thread_rows + (size_t) thread * map->height;
+
+  for (size_t i = task->thread_lines[thread];
+       i < task->thread_lines[thread+1]; i++) {
+    for (size_t j = batch->offsets[i]; j < batch->offsets[i+1]; j++) {
+      int row, col;
+      if (!gather_pixel (map, batch, i, j, &row, &col)) continue;
+      GatherEntry *e = &task->entries[fill[row]++];
+      e->col = col;
+      e->segment = j - task->segment_base;
+    }
+  }
+}
+
+/* Return the first of lines start to end whose first segment is at
+ * or after segment s. */
+static size_t
+gather_find_line (const ChangeMapBatch *batch, size_t start, size_t end,
+                  size_t s)
+{
+  while (start < end) {
+    size_t mid = start + (end - start) / 2;
+    if (batch->offsets[mid] < s) {
+      start = mid + 1;
+    } else {
+      end = mid;
+    }
+  }
+  return start;
+}
+
+/* Calculate the change for the segments of lines task->line_start to
+ * task->line_end.  Rather than sampling the images in line order,
+ * which is effectively random access, the sample pixels are bucketed
+ * by row with a counting sort.  The rows are then visited in order,
+ * so that only a few image rows are in use at any time; each distinct
+ * pixel is evaluated once, and the result is copied to every segment
+ * that samples it.
+ *
+ * The bucketing is shared between threads by giving each thread an
+ * equal share of the segments, rounded to whole lines.  Each thread
+ * counts its pixels in each row, and a prefix sum over the rows, and
+ * over the threads within each row, gives each thread its own fill
+ * position in every row.  The entries in each row are therefore in
+ * the same order however many threads are used. */
+static void
+gather_lines (ComputeAllTask *task)
+{
+  ChangeMap *map = task->map;
+  ChangeMapBatch *batch = task->batch;
+  size_t height = map->height;
+  size_t n_lines = task->line_end - task->line_start;
+  size_t n_segments = (batch->offsets[task->line_end]
+                       - batch->offsets[task->line_start]);
+
+  int n_threads = MIN (map->threads, MAX (n_lines, 1));
+  task->segment_base = batch->offsets[task->line_start];
+  task->thread_lines = g_new (size_t, n_threads + 1);
+  for (int t = 0; t < n_threads; t++) {
+    task->thread_lines[t] =
+      gather_find_line (batch, task->line_start, task->line_end,
+                        task->segment_base + n_segments / n_threads * t);
+  }
+  task->thread_lines[n_threads] = task->line_end;
+  task->thread_rows = g_new (size_t, MAX ((size_t) n_threads * height, 1));
+
+  parallel_run (n_threads, gather_count_thread, task);
+
+  size_t *row_start = g_new (size_t, height + 1);
+  size_t n = 0;
+  for (size_t r = 0; r < height; r++) {
+    row_start[r] = n;
+    for (int t = 0; t < n_threads; t++) {
+      size_t count = task->thread_rows[t * height + r];
+      task->thread_rows[t * height + r] = n;
+      n += count;
+    }
+  }
+  row_start[height] = n;
+
+  task->row_start = row_start;
+  task->entries = g_new (GatherEntry, MAX (n, 1));
+  parallel_run (n_threads, gather_fill_thread, task);
+  g_free (task->thread_rows);
+  g_free (task->thread_lines);
+  task->thread_rows = NULL;
+  task->thread_lines = NULL;
+
+  task->next_row = 0;
+  if (map->local_radius > 0) {
+    task->band_rows = MAX (LOCAL_BAND_ROWS, 4 * map->local_radius);
+    task->n_bands = (map->height + task->band_rows - 1) / task->band_rows;
+    task->next_band = 0;
+    parallel_run (MIN (map->threads, MAX (task->n_bands, 1)),
+                  gather_local_thread, task);
+  } else {
+    parallel_run (MIN (map->threads, MAX (map->height, 1)),
+                  gather_rows_thread, task);
+  }
+
+  g_free (task->row_start);
+  g_free (task->entries);
+  task->row_start = NULL;
+  task->entries = NULL;
+}
+
+/* Calculate the change for every segment in the batch, gathering a
+ * chunk of lines at a time so that segment indices fit in a
+ * GatherEntry.  Lines are never split between chunks, so a single line
+ * can't have more than GATHER_MAX_SEGMENTS segments. */
+static void
+compute_all_gather (ComputeAllTask *task)
+{
+  ChangeMapBatch *batch = task->batch;
+
+  size_t start = 0;
+  while (start < batch->n_lines) {
+    size_t end = gather_find_line (batch, start, batch->n_lines,
+                                   batch->offsets[start]
+                                   + GATHER_MAX_SEGMENTS + 1);
+    if (batch->offsets[end] - batch->offsets[start] > GATHER_MAX_SEGMENTS) {
+      end--;
+    }
+    g_assert (end > start);
+    task->line_start = start;
+    task->line_end = end;
+    gather_lines (task);
+    start = end;
+  }
+}
+
+/* With local calibration, change_map_get_line() can't look up the
+ * window mean for each segment on its own, so the change for every
+ * line is calculated on the first call and kept as precomputed
+ * segment changes. */
+static void
+local_segment_changes (ChangeMap *map)
+{
+  g_mutex_lock (&map->calibration_lock);
+  if (!map->segment_changes) {
+    ChangeMapBatch *batch = change_map_compute_all (map);
+    size_t *offsets = g_new (size_t, batch->n_lines + 1);
+    float *changes = g_new (float, MAX (batch->n_segments, 1));
+    memcpy (offsets, batch->offsets, (batch->n_lines + 1) * sizeof (size_t));
+    memcpy (changes, batch->change, batch->n_segments * sizeof (float));
+    change_map_batch_free (batch);
+    change_map_set_segment_changes (map, offsets, changes);
+  }
+  g_mutex_unlock (&map->calibration_lock);
+}
+
 /* ================================================================
  * API functions
  * ================================================================ */
@@ -90,13 +591,26 @@ change_map_new ()
 {
   ChangeMap *result = g_new0 (ChangeMap, 1);
   result->ridges = NULL;
+  result->selection = NULL;
+  result->n_selected = 0;
   result->pre = NULL;
   result->post = NULL;
+  result->pre_compact = NULL;
+  result->post_compact = NULL;
   result->nan_val = NAN_VAL;
+  result->threads = 1;
+  result->estimator = ESTIMATOR_MEAN;
+  result->estimator_param = 0;
+  result->local_radius = 0;
 
   result->height = -1;
   result->width = -1;
+  result->origin_row = 0;
+  result->origin_col = 0;
   result->calibration = NAN;
+  g_mutex_init (&result->calibration_lock);
+  result->segment_offsets = NULL;
+  result->segment_changes = NULL;
 
   return result;
 }
@@ -105,6 +619,8 @@ void
 change_map_free (ChangeMap *map)
 {
   /* Assume the various pointers are owned elsewhere */
+  clear_segment_changes (map);
+  g_mutex_clear (&map->calibration_lock);
   g_free (map);
 }
 
@@ -127,8 +643,77 @@ change_map_set_ridge_data (ChangeMap *map, RioData *data)
 
   map->height = height;
   map->width = width;
+  map->origin_row = map->origin_col = 0;
   map->ridges = data;
+  map->selection = NULL;
+  map->n_selected = 0;
+  map->calibration = NAN;
+  clear_segment_changes (map);
+}
+
+/* Restrict the map to the n ridge lines listed in selection, which
+ * must remain valid for the lifetime of the map.  Line i of the map
+ * is then ridge line selection[i].  If selection is NULL, all ridge
+ * lines are used. */
+void
+change_map_set_line_selection (ChangeMap *map, const uint32_t *selection,
+                               size_t n)
+{
+  g_assert (map);
+  g_assert (map->ridges);
+  for (size_t i = 0; selection && i < n; i++) {
+    g_assert (selection[i] < rio_data_get_num_entries (map->ridges));
+  }
+
+  map->selection = selection;
+  map->n_selected = selection ? n : 0;
+  clear_segment_changes (map);
+}
+
+/* Restrict the map to the height x width window of the image with
+ * its top left corner at (row, col).  The pre and post images must
+ * then cover only the window, and segments that sample pixels outside
+ * it get NaN change values.  Unless a calibration value is set, the
+ * map is calibrated over the window. */
+void
+change_map_set_window (ChangeMap *map, int row, int col, int height,
+                       int width)
+{
+  g_assert (map);
+  g_assert (map->ridges);
+  g_assert (row >= 0 && col >= 0 && height > 0 && width > 0);
+  g_assert (row + height <= map->origin_row + map->height);
+  g_assert (col + width <= map->origin_col + map->width);
+
+  map->origin_row = row;
+  map->origin_col = col;
+  map->height = height;
+  map->width = width;
+  map->pre = map->post = NULL;
+  map->pre_compact = map->post_compact = NULL;
   map->calibration = NAN;
+  clear_segment_changes (map);
+}
+
+size_t
+change_map_get_num_lines (ChangeMap *map)
+{
+  g_assert (map);
+  g_assert (map->ridges);
+  if (map->selection) return map->n_selected;
+  return rio_data_get_num_entries (map->ridges);
+}
+
+RioLine *
+change_map_get_ridge_line (ChangeMap *map, size_t index)
+{
+  g_assert (map);
+  g_assert (map->ridges);
+  if (map->selection) {
+    g_assert (index < map->n_selected);
+    index = map->selection[index];
+  }
+  return rio_data_get_line (map->ridges, index);
 }
 
 void
@@ -143,7 +728,9 @@ change_map_set_pre_image (ChangeMap *map, RutSurface *pre)
   }
 
   map->pre = pre;
+  map->pre_compact = map->post_compact = NULL;
   map->calibration = NAN;
+  clear_segment_changes (map);
 }
 
 void
@@ -158,7 +745,31 @@ change_map_set_post_image (ChangeMap *map, RutSurface *post)
   }
 
   map->post = post;
+  map->pre_compact = map->post_compact = NULL;
+  map->calibration = NAN;
+  clear_segment_changes (map);
+}
+
+/* Use compact pre- and post-event images instead of float images.
+ * Their pixels are decoded as they are needed. */
+void
+change_map_set_compact_images (ChangeMap *map, const CompactImage *pre,
+                               const CompactImage *post)
+{
+  g_assert (map);
+  g_assert (pre && post);
+
+  /* Check image size */
+  if (pre->rows != map->height || pre->cols != map->width
+      || post->rows != map->height || post->cols != map->width) {
+    g_error ("Image size mismatch"); /* FIXME */
+  }
+
+  map->pre = map->post = NULL;
+  map->pre_compact = pre;
+  map->post_compact = post;
   map->calibration = NAN;
+  clear_segment_changes (map);
 }
 
 void
@@ -168,6 +779,121 @@ change_map_set_nan (ChangeMap *map, double nan_val)
   g_assert (isnormal (nan_val));
   map->nan_val = nan_val;
   map->calibration = NAN;
+  clear_segment_changes (map);
+}
+
+void
+change_map_set_threads (ChangeMap *map, int threads)
+{
+  g_assert (map);
+  if (threads <= 0) threads = parallel_default_threads ();
+  map->threads = threads;
+}
+
+/* Choose the statistic of the square ratio image used as the
+ * calibration value; see calibrator_set_estimator(). */
+void
+change_map_set_estimator (ChangeMap *map, int estimator, double param)
+{
+  g_assert (map);
+  if (estimator == map->estimator && param == map->estimator_param) return;
+  map->estimator = estimator;
+  map->estimator_param = param;
+  map->calibration = NAN;
+  clear_segment_changes (map);
+}
+
+/* Calibrate each pixel against the mean square ratio over the
+ * (2*radius+1)-pixel square window centred on it, instead of over the
+ * whole image.  A radius of 0 restores global calibration. */
+void
+change_map_set_local_calibration (ChangeMap *map, int radius)
+{
+  g_assert (map);
+  g_assert (radius >= 0);
+  if (radius == map->local_radius) return;
+  map->local_radius = radius;
+  clear_segment_changes (map);
+}
+
+/* Override the calibration value, instead of calculating it from the
+ * pre and post images. */
+void
+change_map_set_calibration (ChangeMap *map, double calibration)
+{
+  g_assert (map);
+  g_assert (isnormal (calibration) && calibration > 0);
+  map->calibration = calibration;
+  clear_segment_changes (map);
+}
+
+/* Calculate the calibration value, if necessary, and return it.
+ * This may be called from several threads at once. */
+double
+change_map_calibrate (ChangeMap *map)
+{
+  g_assert (map);
+  g_mutex_lock (&map->calibration_lock);
+  if (isnan (map->calibration)) recalibrate (map);
+  double result = map->calibration;
+  g_mutex_unlock (&map->calibration_lock);
+  return result;
+}
+
+/* Calculate the calibration values for n_posts post-event images
+ * against the map's pre-event image in a single pass over the
+ * pre-event image, storing them in calibrations.  The map's own
+ * calibration is not changed. */
+void
+change_map_calibrate_series (ChangeMap *map, RutSurface **posts,
+                             int n_posts, double *calibrations)
+{
+  g_assert (map);
+  g_assert (map->pre);
+  g_assert (posts);
+  g_assert (calibrations);
+
+  const float **pre_rows = g_new (const float *, map->height);
+  const float **post_rows = g_new (const float *,
+                                   (size_t) n_posts * map->height);
+  for (int i = 0; i < map->height; i++) {
+    pre_rows[i] = &RUT_SURFACE_REF (map->pre, i, 0);
+  }
+  for (int k = 0; k < n_posts; k++) {
+    g_assert (posts[k]->rows == map->height && posts[k]->cols == map->width);
+    for (int i = 0; i < map->height; i++) {
+      post_rows[(size_t) k * map->height + i] = &RUT_SURFACE_REF (posts[k], i, 0);
+    }
+  }
+
+  Calibrator *cal = calibrator_new_series (map->height, map->width,
+                                           map->nan_val, n_posts,
+                                           map->threads);
+  calibrator_set_estimator (cal, map->estimator, map->estimator_param);
+  calibrator_add_rows (cal, 0, map->height, pre_rows, post_rows);
+  calibrator_finish_series (cal, calibrations);
+  calibrator_free (cal);
+
+  g_free (pre_rows);
+  g_free (post_rows);
+  for (int k = 0; k < n_posts; k++) g_assert (isnormal (calibrations[k]));
+}
+
+/* Provide precomputed change values for every segment of every ridge
+ * line, instead of sampling the pre and post images.  The change
+ * values for line i are changes[offsets[i]] to
+ * changes[offsets[i+1]-1].  The map takes ownership of both
+ * arrays. */
+void
+change_map_set_segment_changes (ChangeMap *map, size_t *offsets,
+                                float *changes)
+{
+  g_assert (map);
+  g_assert (offsets);
+  g_assert (changes);
+  clear_segment_changes (map);
+  map->segment_offsets = offsets;
+  map->segment_changes = changes;
 }
 
 ChangeMapLine *
@@ -175,13 +901,16 @@ change_map_get_line (ChangeMap *map, int index)
 {
   g_assert (map);
   g_assert (map->ridges);
-  g_assert (map->pre);
-  g_assert (map->post);
-  g_assert (index < rio_data_get_num_entries (map->ridges));
+  g_assert (map->segment_changes || has_images (map));
+  g_assert (index < change_map_get_num_lines (map));
 
-  if (isnan(map->calibration)) recalibrate (map);
+  if (map->local_radius > 0) {
+    local_segment_changes (map);
+  } else if (!map->segment_changes) {
+    change_map_calibrate (map);
+  }
 
-  RioLine *ridgeline = rio_data_get_line (map->ridges, index);
+  RioLine *ridgeline = change_map_get_ridge_line (map, index);
   int Np = rio_line_get_length (ridgeline);
 
   /* Allocate result structure */
@@ -191,27 +920,98 @@ change_map_get_line (ChangeMap *map, int index)
   result->coords[1] = g_new0 (uint32_t, Np);
   result->change = g_new0 (float, Np - 1);
 
-  /* Copy in coordinate data */
-  for (int i = 0; i < Np; i++) {
-    RioPoint *p = rio_line_get_point (ridgeline, i);
-    result->coords[0][i] = p->row;
-    result->coords[1][i] = p->col;
+  fill_line (map, index, result->coords[0], result->coords[1],
+             result->change);
+  return result;
+}
+
+/* Calculate change for every ridge line at once.  All of the results
+ * are stored in a single block of memory, which is released with
+ * change_map_batch_free().  The batch refers to the map's line
+ * selection, so the selection must not be freed before the batch. */
+ChangeMapBatch *
+change_map_compute_all (ChangeMap *map)
+{
+  g_assert (map);
+  g_assert (map->ridges);
+  g_assert (map->segment_changes || has_images (map));
+
+  int local = (map->local_radius > 0 && !map->segment_changes);
+  if (!map->segment_changes && !local) change_map_calibrate (map);
+
+  /* Count segments */
+  size_t N = change_map_get_num_lines (map);
+  size_t M = 0;
+  for (size_t i = 0; i < N; i++) {
+    int Np = rio_line_get_length (change_map_get_ridge_line (map, i));
+    g_assert (Np > 0);
+    M += Np - 1;
   }
 
-  /* Calculate change coefficients */
-  for (int i = 0; i < result->n_segments; i++) {
-    int row, col;
-    change_map_line_get_pixel (result, i, &row, &col);
-    g_assert (row < map->height);
-    g_assert (col < map->width);
+  /* Allocate arena.  Each line has one more point than it has
+   * segments. */
+  size_t header_size = sizeof (ChangeMapBatch);
+  header_size += (sizeof (size_t) - header_size % sizeof (size_t)) % sizeof (size_t);
+  size_t size = (header_size
+                 + (N + 1) * sizeof (size_t)
+                 + 2 * (M + N) * sizeof (uint32_t)
+                 + (local ? 2 : 1) * M * sizeof (float));
+  char *arena = g_malloc (size);
 
-    double r = square_ratio (map, row, col);
-    double d = 1 - map->calibration / r;
-    g_assert (isnormal (d));
-    result->change[i] = d;
+  ChangeMapBatch *batch = (ChangeMapBatch *) arena;
+  batch->n_lines = N;
+  batch->n_segments = M;
+  batch->offsets = (size_t *) (arena + header_size);
+  batch->coords[0] = (uint32_t *) (batch->offsets + N + 1);
+  batch->coords[1] = batch->coords[0] + M + N;
+  batch->change = (float *) (batch->coords[1] + M + N);
+  batch->calibration = map->calibration;
+  batch->calibrations = local ? batch->change + M : NULL;
+  batch->selection = map->selection;
+
+  batch->offsets[0] = 0;
+  for (size_t i = 0; i < N; i++) {
+    int Np = rio_line_get_length (change_map_get_ridge_line (map, i));
+    batch->offsets[i+1] = batch->offsets[i] + Np - 1;
   }
 
-  return result;
+  /* Line lengths are very uneven, so use work stealing to share the
+   * lines between threads. */
+  ComputeAllTask task;
+  task.map = map;
+  task.batch = batch;
+  task.thread_lines = NULL;
+  task.thread_rows = NULL;
+  task.row_start = NULL;
+  task.entries = NULL;
+  parallel_for_stealing (map->threads, N, COMPUTE_ALL_GRAIN,
+                         compute_all_range, &task);
+
+  if (!map->segment_changes) compute_all_gather (&task);
+
+  return batch;
+}
+
+void
+change_map_batch_free (ChangeMapBatch *batch)
+{
+  g_free (batch);
+}
+
+/* Find the pixel sampled by a segment of a line in a batch.  segment
+ * is counted from the start of the line. */
+void
+change_map_batch_get_pixel (const ChangeMapBatch *batch, size_t line,
+                            size_t segment, int *row, int *col)
+{
+  g_assert (batch);
+  g_assert (line < batch->n_lines);
+  g_assert (batch->offsets[line] + segment < batch->offsets[line+1]);
+
+  size_t p = batch->offsets[line] + line + segment;
+  change_map_segment_pixel (batch->coords[0][p], batch->coords[1][p],
+                            batch->coords[0][p+1], batch->coords[1][p+1],
+                            row, col);
 }
 
 void
@@ -228,16 +1028,12 @@ void
 change_map_line_get_pixel (const ChangeMapLine *line, int segment,
                            int *row, int *col)
 {
-  uint64_t lrow, lcol;
   g_assert (line);
   g_assert (segment < line->n_segments);
 
-  lrow = ((uint64_t) line->coords[0][segment]
-          + (uint64_t) line->coords[0][segment + 1]) >> 8;
-
-  lcol = ((uint64_t) line->coords[1][segment]
-          + (uint64_t) line->coords[1][segment + 1]) >> 8;
-
-  *row = (int) lrow;
-  *col = (int) lcol;
+  change_map_segment_pixel (line->coords[0][segment],
+                            line->coords[1][segment],
+                            line->coords[0][segment + 1],
+                            line->coords[1][segment + 1],
+                            row, col);
 }
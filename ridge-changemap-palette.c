@@ -0,0 +1,168 @@
+/*
+ * Surrey Space Centre urban change detection tool for SAR
+ * Copyright (C) 2013 Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <glib.h>
+
+#include <ridgeio.h>
+#include <ridgeutil.h>
+
+#include "ridge-changemap.h"
+
+/* A palette is defined by a list of colour stops with increasing
+ * change values, plus a background colour.  Colours are linearly
+ * interpolated between stops, and clamped to the first and last stop
+ * outside them.  The palette is compiled into a lookup table of packed
+ * RGB24 values covering the range from 0 to the last stop, so that
+ * exporters never have to search the list of stops. */
+
+typedef struct _PaletteStop PaletteStop;
+struct _PaletteStop {
+  double v;
+  uint8_t r, g, b;
+};
+
+static const PaletteStop DEFAULT_STOPS[] = {
+  { 0.00, 242,242,242},
+  { 0.50, 153,153,153},
+  { 0.75, 64,64,64},
+  { 1.00, 0,0,255},
+};
+static const PaletteStop DEFAULT_BACKGROUND = { NAN, 255, 255, 255};
+
+static uint32_t
+pack_rgb (int r, int g, int b)
+{
+  return ((uint32_t) r << 16) | ((uint32_t) g << 8) | (uint32_t) b;
+}
+
+static Palette *
+palette_compile (const PaletteStop *stops, int n_stops,
+                 const PaletteStop *background)
+{
+  g_assert (n_stops >= 2);
+  g_assert (stops[n_stops - 1].v > 0);
+
+  Palette *palette = g_new (Palette, 1);
+  palette->background = pack_rgb (background->r, background->g,
+                                  background->b);
+  palette->scale = (PALETTE_LUT_SIZE - 1) / stops[n_stops - 1].v;
+
+  int s = 0;
+  for (int i = 0; i < PALETTE_LUT_SIZE; i++) {
+    double d = i / palette->scale;
+    while (s < n_stops - 2 && d > stops[s+1].v) s++;
+
+    const PaletteStop *start = &stops[s], *end = &stops[s+1];
+    double x = (d - start->v) / (end->v - start->v);
+    x = CLAMP (x, 0, 1);
+    palette->lut[i] = pack_rgb ((int) (x * end->r + (1-x) * start->r),
+                                (int) (x * end->g + (1-x) * start->g),
+                                (int) (x * end->b + (1-x) * start->b));
+  }
+  return palette;
+}
+
+/* Parse a line "R G B" giving colour components in the range 0-255.
+ * Returns TRUE on success. */
+static int
+parse_rgb (const char *str, PaletteStop *stop)
+{
+  int r, g, b, end = -1;
+  if (sscanf (str, "%i %i %i %n", &r, &g, &b, &end) != 3
+      || str[end] != 0
+      || r < 0 || r > 255 || g < 0 || g > 255 || b < 0 || b > 255) {
+    return FALSE;
+  }
+  stop->r = r;
+  stop->g = g;
+  stop->b = b;
+  return TRUE;
+}
+
+/* ================================================================
+ * API functions
+ * ================================================================ */
+
+/* Create the built-in palette, which shades from light grey for no
+ * change to blue for maximum change, on a white background. */
+Palette *
+palette_new_default (void)
+{
+  return palette_compile (DEFAULT_STOPS, G_N_ELEMENTS (DEFAULT_STOPS),
+                          &DEFAULT_BACKGROUND);
+}
+
+/* Load a palette from filename.  Each line of the file contains
+ * either "VALUE R G B", giving a colour stop, or "background R G B",
+ * giving the background colour.  Blank lines and lines starting with
+ * '#' are ignored.  At least two stops are required, with increasing
+ * values, and the last value must be positive.  Returns NULL if the
+ * file cannot be read or is invalid. */
+Palette *
+palette_load (const char *filename)
+{
+  char *contents;
+  if (!g_file_get_contents (filename, &contents, NULL, NULL)) return NULL;
+
+  GArray *stops = g_array_new (FALSE, FALSE, sizeof (PaletteStop));
+  PaletteStop background = DEFAULT_BACKGROUND;
+  int valid = TRUE;
+
+  char **lines = g_strsplit (contents, "\n", -1);
+  for (int i = 0; valid && lines[i] != NULL; i++) {
+    char *line = g_strstrip (lines[i]);
+    if (line[0] == 0 || line[0] == '#') continue;
+
+    if (strncmp (line, "background", 10) == 0) {
+      valid = parse_rgb (line + 10, &background);
+      continue;
+    }
+
+    PaletteStop stop;
+    char *end;
+    stop.v = g_ascii_strtod (line, &end);
+    valid = (end != line && isfinite (stop.v) && parse_rgb (end, &stop)
+             && (stops->len == 0
+                 || stop.v > g_array_index (stops, PaletteStop,
+                                            stops->len - 1).v));
+    if (valid) g_array_append_val (stops, stop);
+  }
+  g_strfreev (lines);
+  g_free (contents);
+
+  Palette *palette = NULL;
+  if (valid && stops->len >= 2
+      && g_array_index (stops, PaletteStop, stops->len - 1).v > 0) {
+    palette = palette_compile ((PaletteStop *) stops->data, stops->len,
+                               &background);
+  }
+  g_array_free (stops, TRUE);
+  return palette;
+}
+
+void
+palette_free (Palette *palette)
+{
+  g_free (palette);
+}
@@ -0,0 +1,197 @@
+/*
+ * Surrey Space Centre urban change detection tool for SAR
+ * Copyright (C) 2013 Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <glib.h>
+
+#include <ridgeio.h>
+#include <ridgeutil.h>
+
+#include "ridge-changemap.h"
+
+typedef struct _ParallelThread ParallelThread;
+struct _ParallelThread {
+  ParallelFunc func;
+  void *user_data;
+  int thread, n_threads;
+};
+
+static gpointer
+parallel_thread_main (gpointer data)
+{
+  ParallelThread *t = (ParallelThread *) data;
+  t->func (t->thread, t->n_threads, t->user_data);
+  return NULL;
+}
+
+/* Work-stealing loop.  The items are initially divided evenly
+ * between the threads.  Each thread takes chunks of grain items from
+ * the front of its own range; when its range is empty, it steals the
+ * back half of another thread's remaining range. */
+
+typedef struct _StealRange StealRange;
+struct _StealRange {
+  GMutex lock;
+  size_t start, end;
+};
+
+typedef struct _StealTask StealTask;
+struct _StealTask {
+  StealRange *ranges;
+  size_t grain;
+  ParallelRangeFunc func;
+  void *user_data;
+};
+
+static int
+steal_take (StealRange *r, size_t grain, size_t *start, size_t *end)
+{
+  int status = FALSE;
+  g_mutex_lock (&r->lock);
+  if (r->start < r->end) {
+    *start = r->start;
+    *end = MIN (r->start + grain, r->end);
+    r->start = *end;
+    status = TRUE;
+  }
+  g_mutex_unlock (&r->lock);
+  return status;
+}
+
+static int
+steal_from (StealRange *victim, StealRange *thief)
+{
+  size_t start = 0, end = 0;
+  g_mutex_lock (&victim->lock);
+  if (victim->start < victim->end) {
+    size_t n = victim->end - victim->start;
+    start = victim->end - (n + 1) / 2;
+    end = victim->end;
+    victim->end = start;
+  }
+  g_mutex_unlock (&victim->lock);
+  if (start == end) return FALSE;
+
+  g_mutex_lock (&thief->lock);
+  thief->start = start;
+  thief->end = end;
+  g_mutex_unlock (&thief->lock);
+  return TRUE;
+}
+
+static void
+steal_thread (int thread, int n_threads, void *user_data)
+{
+  StealTask *task = (StealTask *) user_data;
+  StealRange *own = &task->ranges[thread];
+
+  while (1) {
+    size_t start, end;
+    if (steal_take (own, task->grain, &start, &end)) {
+      task->func (start, end, task->user_data);
+      continue;
+    }
+
+    int stolen = FALSE;
+    for (int i = 1; !stolen && i < n_threads; i++) {
+      stolen = steal_from (&task->ranges[(thread + i) % n_threads], own);
+    }
+    if (!stolen) break;
+  }
+}
+
+/* ================================================================
+ * API functions
+ * ================================================================ */
+
+int
+parallel_default_threads (void)
+{
+  return MAX (1, (int) g_get_num_processors ());
+}
+
+/* Run func on n_threads threads, and wait for all of them to finish.
+ * The calling thread is used as thread 0. */
+void
+parallel_run (int n_threads, ParallelFunc func, void *user_data)
+{
+  g_assert (func);
+  if (n_threads <= 0) n_threads = parallel_default_threads ();
+
+  if (n_threads == 1) {
+    func (0, 1, user_data);
+    return;
+  }
+
+  ParallelThread *threads = g_new0 (ParallelThread, n_threads);
+  GThread **handles = g_new0 (GThread *, n_threads);
+
+  for (int i = 0; i < n_threads; i++) {
+    threads[i].func = func;
+    threads[i].user_data = user_data;
+    threads[i].thread = i;
+    threads[i].n_threads = n_threads;
+  }
+  for (int i = 1; i < n_threads; i++) {
+    handles[i] = g_thread_new ("ridge-changemap", parallel_thread_main,
+                               &threads[i]);
+  }
+
+  parallel_thread_main (&threads[0]);
+
+  for (int i = 1; i < n_threads; i++) {
+    g_thread_join (handles[i]);
+  }
+
+  g_free (handles);
+  g_free (threads);
+}
+
+/* Call func on consecutive ranges of items from 0 to n_items-1,
+ * using n_threads threads with work stealing.  Each range contains
+ * at most grain items. */
+void
+parallel_for_stealing (int n_threads, size_t n_items, size_t grain,
+                       ParallelRangeFunc func, void *user_data)
+{
+  g_assert (func);
+  if (n_items == 0) return;
+  if (n_threads <= 0) n_threads = parallel_default_threads ();
+  if (grain == 0) grain = 1;
+  n_threads = MIN ((size_t) n_threads, (n_items + grain - 1) / grain);
+
+  StealTask task;
+  task.ranges = g_new0 (StealRange, n_threads);
+  task.grain = grain;
+  task.func = func;
+  task.user_data = user_data;
+
+  for (int i = 0; i < n_threads; i++) {
+    g_mutex_init (&task.ranges[i].lock);
+    task.ranges[i].start = n_items * i / n_threads;
+    task.ranges[i].end = n_items * (i + 1) / n_threads;
+  }
+
+  parallel_run (n_threads, steal_thread, &task);
+
+  for (int i = 0; i < n_threads; i++) {
+    g_mutex_clear (&task.ranges[i].lock);
+  }
+  g_free (task.ranges);
+}
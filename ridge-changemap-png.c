@@ -0,0 +1,134 @@
+/*
+ * Surrey Space Centre urban change detection tool for SAR
+ * Copyright (C) 2013 Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <glib.h>
+#include <png.h>
+
+#include <ridgeio.h>
+#include <ridgeutil.h>
+
+#include "ridge-changemap.h"
+
+/* A PNG writer accepts rows of packed 0xRRGGBB pixels (the layout of
+ * a cairo RGB24 surface) in order from top to bottom, and encodes
+ * them immediately, so that an image can be written without ever
+ * holding all of it in memory. */
+
+struct _PngWriter {
+  char *filename;
+  FILE *fp;
+  png_structp png;
+  png_infop info;
+  size_t width;
+  png_bytep row; /* Conversion buffer */
+};
+
+static void
+png_writer_error (png_structp png, png_const_charp msg)
+{
+  PngWriter *w = (PngWriter *) png_get_error_ptr (png);
+  fprintf (stderr, "ERROR: Could not write to '%s': %s.\n",
+           w->filename, msg);
+  exit (4);
+}
+
+static void
+png_writer_warning (png_structp png, png_const_charp msg)
+{
+}
+
+/* ================================================================
+ * API functions
+ * ================================================================ */
+
+PngWriter *
+png_writer_open (const char *filename, size_t width, size_t height)
+{
+  g_assert (filename);
+
+  PngWriter *w = g_new0 (PngWriter, 1);
+  w->filename = g_strdup (filename);
+  w->width = width;
+
+  w->fp = fopen (filename, "wb");
+  if (w->fp == NULL) {
+    fprintf (stderr, "ERROR: Could not write to '%s': %s.\n",
+             filename, strerror (errno));
+    exit (4);
+  }
+
+  /* Errors are reported through png_writer_error(), which doesn't
+   * return, so there is no need for setjmp(). */
+  w->png = png_create_write_struct (PNG_LIBPNG_VER_STRING, w,
+                                    png_writer_error, png_writer_warning);
+  w->info = png_create_info_struct (w->png);
+  g_assert (w->png && w->info);
+
+  png_init_io (w->png, w->fp);
+  png_set_IHDR (w->png, w->info, width, height, 8, PNG_COLOR_TYPE_RGB,
+                PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                PNG_FILTER_TYPE_DEFAULT);
+  png_write_info (w->png, w->info);
+
+  w->row = g_malloc (3 * width);
+  return w;
+}
+
+/* Encode n_rows rows of pixels, with stride pixels between the start
+ * of each row. */
+void
+png_writer_write_rows (PngWriter *w, const uint32_t *pixels, size_t stride,
+                       size_t n_rows)
+{
+  g_assert (w);
+
+  for (size_t i = 0; i < n_rows; i++) {
+    const uint32_t *src = pixels + i * stride;
+    for (size_t j = 0; j < w->width; j++) {
+      w->row[3*j] = (src[j] >> 16) & 0xff;
+      w->row[3*j + 1] = (src[j] >> 8) & 0xff;
+      w->row[3*j + 2] = src[j] & 0xff;
+    }
+    png_write_row (w->png, w->row);
+  }
+}
+
+void
+png_writer_close (PngWriter *w)
+{
+  g_assert (w);
+
+  png_write_end (w->png, w->info);
+  png_destroy_write_struct (&w->png, &w->info);
+
+  if (ferror (w->fp) | fclose (w->fp)) {
+    fprintf (stderr, "ERROR: Could not write to '%s': %s.\n",
+             w->filename, strerror (errno));
+    exit (4);
+  }
+  g_free (w->row);
+  g_free (w->filename);
+  g_free (w);
+}
@@ -0,0 +1,248 @@
+/*
+ * Surrey Space Centre urban change detection tool for SAR
+ * Copyright (C) 2013 Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <glib.h>
+
+#include <ridgeio.h>
+#include <ridgeutil.h>
+
+#include "ridge-changemap.h"
+
+/* A profile accumulates the wall-clock and CPU time spent in each
+ * named phase of a run, along with the number of items (pixels or
+ * segments) processed by each phase and some overall counters.
+ * Phases with the same name are added together.  CPU time is for the
+ * whole process, so it includes worker threads; if phases run
+ * concurrently (as in batch mode) their CPU times overlap.
+ *
+ * All of the functions accept a NULL profile and do nothing, so
+ * profiling costs a pointer test when it is turned off. */
+
+#define PROFILE_MAX_ENTRIES 32
+
+typedef struct _ProfilePhase ProfilePhase;
+struct _ProfilePhase {
+  const char *name;
+  size_t calls;
+  gint64 wall, cpu; /* Microseconds */
+  uint64_t items;
+};
+
+typedef struct _ProfileCounter ProfileCounter;
+struct _ProfileCounter {
+  const char *name;
+  uint64_t value;
+};
+
+struct _Profile {
+  GMutex lock;
+  ProfileTimer total;
+  int n_phases, n_counters;
+  ProfilePhase phases[PROFILE_MAX_ENTRIES];
+  ProfileCounter counters[PROFILE_MAX_ENTRIES];
+};
+
+static gint64
+profile_cpu_time (void)
+{
+  struct rusage usage;
+  getrusage (RUSAGE_SELF, &usage);
+  return ((gint64) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000
+          + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+static long
+profile_peak_rss (void)
+{
+  struct rusage usage;
+  getrusage (RUSAGE_SELF, &usage);
+  return usage.ru_maxrss; /* KiB */
+}
+
+static uint64_t
+profile_counter_get (Profile *p, const char *name)
+{
+  for (int i = 0; i < p->n_counters; i++) {
+    if (strcmp (p->counters[i].name, name) == 0) return p->counters[i].value;
+  }
+  return 0;
+}
+
+static void
+profile_write_json (Profile *p, GString *s, double wall, double cpu)
+{
+  g_string_append_printf (s, "{\n  \"wall\": %.6f,\n  \"cpu\": %.6f,\n"
+                          "  \"peak_rss_kib\": %li,\n", wall, cpu,
+                          profile_peak_rss ());
+  uint64_t pixels = profile_counter_get (p, "pixels");
+  g_string_append_printf (s, "  \"pixels_per_sec\": %.6g,\n",
+                          (wall > 0) ? pixels / wall : 0);
+
+  g_string_append (s, "  \"counters\": {");
+  for (int i = 0; i < p->n_counters; i++) {
+    g_string_append_printf (s, "%s\n    \"%s\": %" G_GUINT64_FORMAT,
+                            (i > 0) ? "," : "", p->counters[i].name,
+                            p->counters[i].value);
+  }
+  g_string_append (s, "\n  },\n  \"phases\": [");
+  for (int i = 0; i < p->n_phases; i++) {
+    ProfilePhase *ph = &p->phases[i];
+    double ph_wall = ph->wall / 1e6;
+    g_string_append_printf (s, "%s\n    {\"name\": \"%s\", \"calls\": %zu, "
+                            "\"wall\": %.6f, \"cpu\": %.6f, "
+                            "\"items\": %" G_GUINT64_FORMAT ", "
+                            "\"items_per_sec\": %.6g}",
+                            (i > 0) ? "," : "", ph->name, ph->calls,
+                            ph_wall, ph->cpu / 1e6, ph->items,
+                            (ph_wall > 0) ? ph->items / ph_wall : 0);
+  }
+  g_string_append (s, "\n  ]\n}\n");
+}
+
+static void
+profile_write_summary (Profile *p, FILE *fp, double wall, double cpu)
+{
+  fprintf (fp, "Profile:\n");
+  fprintf (fp, "  %-16s %6s %10s %10s %14s\n",
+           "phase", "calls", "wall/s", "cpu/s", "items/s");
+  for (int i = 0; i < p->n_phases; i++) {
+    ProfilePhase *ph = &p->phases[i];
+    double ph_wall = ph->wall / 1e6;
+    fprintf (fp, "  %-16s %6zu %10.4f %10.4f", ph->name, ph->calls,
+             ph_wall, ph->cpu / 1e6);
+    if (ph->items > 0 && ph_wall > 0) {
+      fprintf (fp, " %14.4g", ph->items / ph_wall);
+    }
+    fputc ('\n', fp);
+  }
+  fprintf (fp, "  %-16s %6s %10.4f %10.4f\n", "total", "", wall, cpu);
+
+  for (int i = 0; i < p->n_counters; i++) {
+    fprintf (fp, "  %s: %" G_GUINT64_FORMAT "\n", p->counters[i].name,
+             p->counters[i].value);
+  }
+  uint64_t pixels = profile_counter_get (p, "pixels");
+  if (pixels > 0 && wall > 0) {
+    fprintf (fp, "  pixels/s: %.4g\n", pixels / wall);
+  }
+  fprintf (fp, "  peak RSS: %li KiB\n", profile_peak_rss ());
+}
+
+/* ================================================================
+ * API functions
+ * ================================================================ */
+
+Profile *
+profile_new (void)
+{
+  Profile *p = g_new0 (Profile, 1);
+  g_mutex_init (&p->lock);
+  profile_start (p, &p->total);
+  return p;
+}
+
+void
+profile_free (Profile *p)
+{
+  if (!p) return;
+  g_mutex_clear (&p->lock);
+  g_free (p);
+}
+
+/* Start timing a phase. */
+void
+profile_start (Profile *p, ProfileTimer *t)
+{
+  if (!p) return;
+  t->wall = g_get_monotonic_time ();
+  t->cpu = profile_cpu_time ();
+}
+
+/* Finish timing a phase started with profile_start(), and add the
+ * time taken and the n_items items processed to the phase called
+ * name, which must be a static string.  May be called from any
+ * thread. */
+void
+profile_stop (Profile *p, ProfileTimer *t, const char *name, uint64_t n_items)
+{
+  if (!p) return;
+  gint64 wall = g_get_monotonic_time () - t->wall;
+  gint64 cpu = profile_cpu_time () - t->cpu;
+
+  g_mutex_lock (&p->lock);
+  int i;
+  for (i = 0; i < p->n_phases; i++) {
+    if (strcmp (p->phases[i].name, name) == 0) break;
+  }
+  if (i == p->n_phases) {
+    g_assert (p->n_phases < PROFILE_MAX_ENTRIES);
+    p->phases[p->n_phases++].name = name;
+  }
+  p->phases[i].calls++;
+  p->phases[i].wall += wall;
+  p->phases[i].cpu += cpu;
+  p->phases[i].items += n_items;
+  g_mutex_unlock (&p->lock);
+}
+
+/* Add n to the counter called name, which must be a static string. */
+void
+profile_count (Profile *p, const char *name, uint64_t n)
+{
+  if (!p) return;
+  g_mutex_lock (&p->lock);
+  int i;
+  for (i = 0; i < p->n_counters; i++) {
+    if (strcmp (p->counters[i].name, name) == 0) break;
+  }
+  if (i == p->n_counters) {
+    g_assert (p->n_counters < PROFILE_MAX_ENTRIES);
+    p->counters[p->n_counters++].name = name;
+  }
+  p->counters[i].value += n;
+  g_mutex_unlock (&p->lock);
+}
+
+/* Report the profile.  If filename is NULL, a summary is printed to
+ * stderr; otherwise, the profile is written to filename in JSON
+ * format.  Returns FALSE if the file could not be written. */
+int
+profile_report (Profile *p, const char *filename)
+{
+  if (!p) return TRUE;
+  double wall = (g_get_monotonic_time () - p->total.wall) / 1e6;
+  double cpu = (profile_cpu_time () - p->total.cpu) / 1e6;
+
+  if (filename == NULL) {
+    profile_write_summary (p, stderr, wall, cpu);
+    return TRUE;
+  }
+
+  GString *s = g_string_new (NULL);
+  profile_write_json (p, s, wall, cpu);
+  int status = g_file_set_contents (filename, s->str, s->len, NULL);
+  g_string_free (s, TRUE);
+  return status;
+}
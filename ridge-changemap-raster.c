@@ -0,0 +1,177 @@
+/*
+ * Surrey Space Centre urban change detection tool for SAR
+ * Copyright (C) 2013 Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <glib.h>
+#include <tiffio.h>
+
+#include <ridgeio.h>
+#include <ridgeutil.h>
+
+#include "ridge-changemap.h"
+
+/* The ridge mask can be written as a single-channel 32-bit float TIFF,
+ * containing the raw change value at each ridge pixel and NaN
+ * everywhere else.  Only one strip of the raster is held in memory at
+ * a time.  The ridge pixels are first bucketed by strip, and then each
+ * strip is filled in and written in turn. */
+
+/* Target size of each strip, in bytes */
+#define RASTER_STRIP_BYTES (1 << 20)
+
+/* Find the pixel sampled by segment j of line i, relative to (row0,
+ * col0).  Returns FALSE if it lies outside the height x width
+ * image. */
+static int
+ridge_pixel_check (const ChangeMapBatch *batch, size_t row0, size_t col0,
+                   size_t height, size_t width, size_t i, size_t j,
+                   int *row, int *col)
+{
+  change_map_batch_get_pixel (batch, i, j, row, col);
+  if (*row < row0 || *col < col0) return FALSE;
+  *row -= row0;
+  *col -= col0;
+  return (*row < height && *col < width);
+}
+
+/* ================================================================
+ * API functions
+ * ================================================================ */
+
+/* Sort the pixels sampled by the segments in batch into bands of
+ * band_rows rows, using a counting sort.  The pixels for band k are
+ * returned in elements (*band_start)[k] to (*band_start)[k+1]-1 of
+ * the result, in line order, so that where segments overlap the last
+ * one wins.  The image is height x width pixels, with its top left
+ * corner at (row0, col0) in ridge coordinates; pixel coordinates in
+ * the result are relative to that corner, and pixels outside the
+ * image are dropped.  Both arrays should be freed with g_free(). */
+RidgePixel *
+ridge_pixels_bucket (const ChangeMapBatch *batch, size_t row0, size_t col0,
+                     size_t height, size_t width,
+                     size_t band_rows, size_t **band_start)
+{
+  g_assert (batch);
+  g_assert (band_rows > 0);
+  g_assert (band_start);
+
+  size_t n_bands = (height + band_rows - 1) / band_rows;
+  size_t *start = g_new0 (size_t, n_bands + 1);
+  for (size_t i = 0; i < batch->n_lines; i++) {
+    size_t n_segments = batch->offsets[i+1] - batch->offsets[i];
+    for (size_t j = 0; j < n_segments; j++) {
+      int row, col;
+      if (!ridge_pixel_check (batch, row0, col0, height, width, i, j,
+                              &row, &col)) {
+        continue;
+      }
+      start[row / band_rows + 1]++;
+    }
+  }
+  for (size_t k = 0; k < n_bands; k++) start[k+1] += start[k];
+
+  RidgePixel *pixels = g_new (RidgePixel, MAX (start[n_bands], 1));
+  size_t *fill = g_new (size_t, MAX (n_bands, 1));
+  memcpy (fill, start, n_bands * sizeof (size_t));
+  for (size_t i = 0; i < batch->n_lines; i++) {
+    size_t n_segments = batch->offsets[i+1] - batch->offsets[i];
+    for (size_t j = 0; j < n_segments; j++) {
+      int row, col;
+      if (!ridge_pixel_check (batch, row0, col0, height, width, i, j,
+                              &row, &col)) {
+        continue;
+      }
+      RidgePixel *p = &pixels[fill[row / band_rows]++];
+      p->row = row;
+      p->col = col;
+      p->change = batch->change[batch->offsets[i] + j];
+    }
+  }
+  g_free (fill);
+
+  *band_start = start;
+  return pixels;
+}
+
+void
+export_ridge_mask_tiff (const ChangeMapBatch *batch, OutputOptions *cfg)
+{
+  g_assert (batch);
+  g_assert (cfg);
+
+  TIFF *tiff = TIFFOpen (cfg->filename, "w");
+  if (tiff == NULL) {
+    fprintf (stderr, "ERROR: Could not write to '%s'.\n", cfg->filename);
+    exit (4);
+  }
+
+  uint32_t rows_per_strip = MAX (RASTER_STRIP_BYTES / (4 * cfg->width), 1);
+  rows_per_strip = MIN (rows_per_strip, cfg->height);
+  size_t n_strips = (cfg->height + rows_per_strip - 1) / rows_per_strip;
+
+  TIFFSetField (tiff, TIFFTAG_IMAGEWIDTH, (uint32_t) cfg->width);
+  TIFFSetField (tiff, TIFFTAG_IMAGELENGTH, (uint32_t) cfg->height);
+  TIFFSetField (tiff, TIFFTAG_BITSPERSAMPLE, 32);
+  TIFFSetField (tiff, TIFFTAG_SAMPLESPERPIXEL, 1);
+  TIFFSetField (tiff, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
+  TIFFSetField (tiff, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+  TIFFSetField (tiff, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+  TIFFSetField (tiff, TIFFTAG_ROWSPERSTRIP, rows_per_strip);
+  if (cfg->compress) {
+    TIFFSetField (tiff, TIFFTAG_COMPRESSION, COMPRESSION_ADOBE_DEFLATE);
+    TIFFSetField (tiff, TIFFTAG_PREDICTOR, PREDICTOR_FLOATINGPOINT);
+  } else {
+    TIFFSetField (tiff, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+  }
+
+  size_t *strip_start;
+  RidgePixel *pixels = ridge_pixels_bucket (batch, cfg->origin_row,
+                                            cfg->origin_col,
+                                            cfg->height, cfg->width,
+                                            rows_per_strip, &strip_start);
+
+  /* Write strips */
+  float *strip = g_new (float, (size_t) rows_per_strip * cfg->width);
+  for (size_t k = 0; k < n_strips; k++) {
+    uint32_t first_row = k * rows_per_strip;
+    uint32_t n_rows = MIN (rows_per_strip, cfg->height - first_row);
+    size_t n = (size_t) n_rows * cfg->width;
+
+    for (size_t i = 0; i < n; i++) strip[i] = NAN;
+    for (size_t i = strip_start[k]; i < strip_start[k+1]; i++) {
+      strip[(size_t) (pixels[i].row - first_row) * cfg->width
+            + pixels[i].col] = pixels[i].change;
+    }
+
+    if (TIFFWriteEncodedStrip (tiff, k, strip, n * sizeof (float)) < 0) {
+      fprintf (stderr, "ERROR: Could not write to '%s'.\n", cfg->filename);
+      exit (4);
+    }
+  }
+
+  g_free (strip);
+  g_free (pixels);
+  g_free (strip_start);
+  TIFFClose (tiff);
+}
@@ -0,0 +1,333 @@
+/*
+ * Surrey Space Centre urban change detection tool for SAR
+ * Copyright (C) 2013 Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <math.h>
+
+#include <glib.h>
+#include <tiffio.h>
+
+#include <ridgeio.h>
+#include <ridgeutil.h>
+
+#include "ridge-changemap.h"
+
+/* Streaming change map evaluation.  Instead of holding the pre- and
+ * post-event images in memory, rows are read from the TIFF files on
+ * demand.  The calibration pass reads both images from top to
+ * bottom, a few bands of rows at a time, and the ridge pass then
+ * reads only the rows that contain ridge pixels, again from top to
+ * bottom.  Only the strips that contain the rows requested are
+ * read. */
+
+struct _StreamImage {
+  TIFF *tiff;
+  uint32_t rows, cols;
+
+  /* Compressed strips can't be read a row at a time, so the most
+   * recently decoded strip is kept here. */
+  int compressed;
+  uint32_t rows_per_strip;
+  tstrip_t strip;
+  float *strip_buf;
+};
+
+/* ================================================================
+ * API functions
+ * ================================================================ */
+
+StreamImage *
+stream_image_open (const char *filename)
+{
+  uint32_t rows, cols;
+  uint16_t bits, samples, format;
+
+  TIFF *tiff = TIFFOpen (filename, "r");
+  if (tiff == NULL) return NULL;
+
+  /* Only single-channel 32-bit float, strip-based images can be
+   * read a row at a time. */
+  if (!(TIFFGetField (tiff, TIFFTAG_IMAGELENGTH, &rows)
+        && TIFFGetField (tiff, TIFFTAG_IMAGEWIDTH, &cols)
+        && TIFFGetFieldDefaulted (tiff, TIFFTAG_BITSPERSAMPLE, &bits)
+        && TIFFGetFieldDefaulted (tiff, TIFFTAG_SAMPLESPERPIXEL, &samples)
+        && TIFFGetFieldDefaulted (tiff, TIFFTAG_SAMPLEFORMAT, &format))
+      || bits != 32 || samples != 1 || format != SAMPLEFORMAT_IEEEFP
+      || TIFFIsTiled (tiff)) {
+    TIFFClose (tiff);
+    return NULL;
+  }
+
+  uint16_t compression;
+  uint32_t rows_per_strip;
+  TIFFGetFieldDefaulted (tiff, TIFFTAG_COMPRESSION, &compression);
+  TIFFGetFieldDefaulted (tiff, TIFFTAG_ROWSPERSTRIP, &rows_per_strip);
+
+  StreamImage *img = g_new0 (StreamImage, 1);
+  img->tiff = tiff;
+  img->rows = rows;
+  img->cols = cols;
+  img->compressed = (compression != COMPRESSION_NONE);
+  img->rows_per_strip = MIN (rows_per_strip, rows);
+  img->strip = (tstrip_t) -1;
+  img->strip_buf = NULL;
+  return img;
+}
+
+void
+stream_image_close (StreamImage *img)
+{
+  if (!img) return;
+  TIFFClose (img->tiff);
+  g_free (img->strip_buf);
+  g_free (img);
+}
+
+void
+stream_image_get_size (const StreamImage *img, uint32_t *rows, uint32_t *cols)
+{
+  g_assert (img);
+  if (rows) *rows = img->rows;
+  if (cols) *cols = img->cols;
+}
+
+/* Return the number of bytes of decoded strip data that are buffered
+ * while reading img, or 0 if its rows can be read directly. */
+size_t
+stream_image_get_strip_size (const StreamImage *img)
+{
+  g_assert (img);
+  if (!img->compressed) return 0;
+  return (size_t) img->rows_per_strip * img->cols * sizeof (float);
+}
+
+/* Read one row of the image into buf, which must have space for all
+ * of the image columns. */
+int
+stream_image_read_row (StreamImage *img, int row, float *buf)
+{
+  g_assert (img);
+  g_assert (row >= 0 && row < img->rows);
+
+  if (!img->compressed) {
+    return (TIFFReadScanline (img->tiff, buf, row, 0) == 1);
+  }
+
+  tstrip_t strip = TIFFComputeStrip (img->tiff, row, 0);
+  if (strip != img->strip) {
+    size_t size = stream_image_get_strip_size (img);
+    if (img->strip_buf == NULL) img->strip_buf = g_malloc (size);
+    img->strip = strip;
+    if (TIFFReadEncodedStrip (img->tiff, strip, img->strip_buf, size) < 0) {
+      img->strip = (tstrip_t) -1;
+      return FALSE;
+    }
+  }
+
+  size_t offset = (size_t) (row % img->rows_per_strip) * img->cols;
+  memcpy (buf, img->strip_buf + offset, img->cols * sizeof (float));
+  return TRUE;
+}
+
+/* Read the height x width window of the image with its top left
+ * corner at (row, col) into a new surface, which should be freed with
+ * image_destroy().  Only the rows in the window are read.  Returns
+ * NULL if the image could not be read. */
+RutSurface *
+stream_image_read_window (StreamImage *img, int row, int col,
+                          int height, int width)
+{
+  g_assert (img);
+  g_assert (row >= 0 && height > 0 && row + height <= img->rows);
+  g_assert (col >= 0 && width > 0 && col + width <= img->cols);
+
+  RutSurface *result = rut_surface_new (height, width);
+  float *buf = g_new (float, img->cols);
+  for (int i = 0; i < height; i++) {
+    if (!stream_image_read_row (img, row + i, buf)) {
+      rut_surface_destroy (result);
+      result = NULL;
+      break;
+    }
+    memcpy (&RUT_SURFACE_REF (result, i, 0), buf + col,
+            width * sizeof (float));
+  }
+  g_free (buf);
+  return result;
+}
+
+/* Calculate the calibration of the map by reading the images via pre
+ * and post, using at most budget bytes of row and strip buffers.  At
+ * least CALIBRATION_BAND_ROWS rows of each image are buffered, so the
+ * caller should check that the budget allows for them.  Returns FALSE
+ * if either image could not be read. */
+int
+change_map_stream_calibrate (ChangeMap *map, StreamImage *pre,
+                             StreamImage *post, size_t budget)
+{
+  g_assert (map);
+  g_assert (map->origin_row == 0 && map->origin_col == 0);
+  g_assert (pre && pre->rows == map->height && pre->cols == map->width);
+  g_assert (post && post->rows == map->height && post->cols == map->width);
+
+  int status = TRUE;
+  size_t row_size = (size_t) map->width * sizeof (float);
+
+  /* The decoded strips of compressed images come out of the budget
+   * first. */
+  size_t strip_size = (stream_image_get_strip_size (pre)
+                       + stream_image_get_strip_size (post));
+  budget = budget > strip_size ? budget - strip_size : 0;
+
+  /* Rows are passed to the calibrator a whole number of bands at a
+   * time, so the result is identical to calibrating in memory. */
+  size_t max_rows = budget / (2 * row_size);
+  max_rows -= max_rows % CALIBRATION_BAND_ROWS;
+  max_rows = MAX (max_rows, CALIBRATION_BAND_ROWS);
+  int chunk_rows = MIN (max_rows, map->height);
+
+  float *pre_buf = g_new (float, (size_t) chunk_rows * map->width);
+  float *post_buf = g_new (float, (size_t) chunk_rows * map->width);
+  const float **pre_rows = g_new (const float *, chunk_rows);
+  const float **post_rows = g_new (const float *, chunk_rows);
+  for (int i = 0; i < chunk_rows; i++) {
+    pre_rows[i] = pre_buf + (size_t) i * map->width;
+    post_rows[i] = post_buf + (size_t) i * map->width;
+  }
+
+  Calibrator *cal = calibrator_new (map->height, map->width,
+                                    map->nan_val, map->threads);
+  calibrator_set_estimator (cal, map->estimator, map->estimator_param);
+  for (int row = 0; status && row < map->height; row += chunk_rows) {
+    int n = MIN (chunk_rows, map->height - row);
+    for (int i = 0; status && i < n; i++) {
+      status = (stream_image_read_row (pre, row + i,
+                                       pre_buf + (size_t) i * map->width)
+                && stream_image_read_row (post, row + i,
+                                          post_buf + (size_t) i * map->width));
+    }
+    if (status) calibrator_add_rows (cal, row, n, pre_rows, post_rows);
+  }
+  if (status) {
+    map->calibration = calibrator_finish (cal);
+    g_assert (isnormal (map->calibration));
+  }
+
+  calibrator_free (cal);
+  g_free (pre_rows);
+  g_free (post_rows);
+  g_free (pre_buf);
+  g_free (post_buf);
+  return status;
+}
+
+/* Evaluate change for every segment of every ridge line, reading the
+ * images via pre and post.  If the map has not been calibrated, a
+ * calibration pass is carried out first, using at most budget bytes
+ * of row buffers.  Returns FALSE if either image could not be
+ * read. */
+int
+change_map_stream (ChangeMap *map, StreamImage *pre, StreamImage *post,
+                   size_t budget)
+{
+  g_assert (map);
+  g_assert (map->ridges);
+  g_assert (map->origin_row == 0 && map->origin_col == 0);
+  g_assert (map->local_radius == 0);
+  g_assert (pre && pre->rows == map->height && pre->cols == map->width);
+  g_assert (post && post->rows == map->height && post->cols == map->width);
+
+  int status = TRUE;
+
+  if (isnan (map->calibration)
+      && !change_map_stream_calibrate (map, pre, post, budget)) {
+    return FALSE;
+  }
+
+  /* Find the pixel sampled by each segment */
+  size_t N = change_map_get_num_lines (map);
+  size_t *offsets = g_new (size_t, N + 1);
+  offsets[0] = 0;
+  for (size_t i = 0; i < N; i++) {
+    RioLine *l = change_map_get_ridge_line (map, i);
+    offsets[i+1] = offsets[i] + MAX (rio_line_get_length (l) - 1, 0);
+  }
+  size_t M = offsets[N];
+
+  uint32_t *rows = g_new (uint32_t, M);
+  uint32_t *cols = g_new (uint32_t, M);
+  for (size_t i = 0; i < N; i++) {
+    RioLine *l = change_map_get_ridge_line (map, i);
+    for (size_t j = offsets[i]; j < offsets[i+1]; j++) {
+      RioPoint *a = rio_line_get_point (l, j - offsets[i]);
+      RioPoint *b = rio_line_get_point (l, j - offsets[i] + 1);
+      int row, col;
+      change_map_segment_pixel (a->row, a->col, b->row, b->col, &row, &col);
+      g_assert (row < map->height);
+      g_assert (col < map->width);
+      rows[j] = row;
+      cols[j] = col;
+    }
+  }
+
+  /* Sort segments by row (counting sort) */
+  size_t *row_start = g_new0 (size_t, map->height + 1);
+  for (size_t j = 0; j < M; j++) row_start[rows[j] + 1]++;
+  for (int i = 0; i < map->height; i++) row_start[i+1] += row_start[i];
+  size_t *order = g_new (size_t, M);
+  size_t *fill = g_new (size_t, map->height);
+  memcpy (fill, row_start, map->height * sizeof (size_t));
+  for (size_t j = 0; j < M; j++) order[fill[rows[j]]++] = j;
+  g_free (fill);
+
+  /* Ridge pass, reading only the rows that are needed */
+  float *changes = g_new (float, M);
+  float *pre_row = g_new (float, map->width);
+  float *post_row = g_new (float, map->width);
+  for (int i = 0; status && i < map->height; i++) {
+    if (row_start[i] == row_start[i+1]) continue;
+    status = (stream_image_read_row (pre, i, pre_row)
+              && stream_image_read_row (post, i, post_row));
+    for (size_t k = row_start[i]; status && k < row_start[i+1]; k++) {
+      size_t j = order[k];
+      double r = kernel_square_ratio (pre_row[cols[j]], post_row[cols[j]],
+                                      map->nan_val);
+      double d = 1 - map->calibration / r;
+      g_assert (isnormal (d));
+      changes[j] = d;
+    }
+  }
+
+  g_free (pre_row);
+  g_free (post_row);
+  g_free (order);
+  g_free (row_start);
+  g_free (rows);
+  g_free (cols);
+
+  if (!status) {
+    g_free (changes);
+    g_free (offsets);
+    return FALSE;
+  }
+
+  change_map_set_segment_changes (map, offsets, changes);
+  return TRUE;
+}
@@ -0,0 +1,244 @@
+/*
+ * Surrey Space Centre urban change detection tool for SAR
+ * Copyright (C) 2013 Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <glib.h>
+#include <ridgeio.h>
+#include <ridgeutil.h>
+
+#include "ridge-changemap.h"
+
+/* The binary change table contains one record per ridge line segment,
+ * stored column by column so that it can be memory-mapped and scanned
+ * without parsing.  All values are little-endian.  The file starts
+ * with an 88 byte header:
+ *
+ *   offset  type       contents
+ *        0  char[8]    magic "RCMTABLE"
+ *        8  uint32     format version (2)
+ *       12  uint32     number of columns (5)
+ *       16  uint64     number of segments, N
+ *       24  uint32     rows covered (the window height, with -w)
+ *       28  uint32     columns covered (the window width, with -w)
+ *       32  uint32     image row of the top of the window (or 0)
+ *       36  uint32     image column of the left of the window (or 0)
+ *       40  float64    global calibration (NaN if calibrated locally)
+ *       48  uint64[5]  file offset of each column
+ *
+ * The row and col columns are always whole-image coordinates, so
+ * with a window they lie between the origin and the origin plus the
+ * rows and columns covered.  Version 1 had an 80 byte header without
+ * the window origin.
+ *
+ * followed by the columns, each of N 4-byte values and starting on an
+ * 8 byte boundary:
+ *
+ *   line         uint32   index of the ridge line in the CRDG file
+ *   row          uint32   pixel row sampled by the segment
+ *   col          uint32   pixel column sampled by the segment
+ *   change       float32  change value (may be NaN)
+ *   calibration  float32  calibration used for the segment
+ */
+
+#define TABLE_MAGIC "RCMTABLE"
+#define TABLE_VERSION 2
+#define TABLE_HEADER_SIZE 88
+#define TABLE_BUFFER_SIZE 4096
+
+enum TableColumn {
+  COLUMN_LINE,
+  COLUMN_ROW,
+  COLUMN_COL,
+  COLUMN_CHANGE,
+  COLUMN_CALIBRATION,
+  N_COLUMNS,
+};
+
+static void
+table_write_check (const void *data, size_t size, FILE *fp,
+                   const char *filename)
+{
+  if (fwrite (data, 1, size, fp) != size) {
+    fprintf (stderr, "ERROR: Could not write to '%s': %s.\n",
+             filename, strerror (errno));
+    exit (4);
+  }
+}
+
+static void
+put_uint32 (uint8_t *p, uint32_t v)
+{
+  v = GUINT32_TO_LE (v);
+  memcpy (p, &v, 4);
+}
+
+static void
+put_uint64 (uint8_t *p, uint64_t v)
+{
+  v = GUINT64_TO_LE (v);
+  memcpy (p, &v, 8);
+}
+
+static void
+put_float (uint8_t *p, float f)
+{
+  uint32_t v;
+  memcpy (&v, &f, 4);
+  put_uint32 (p, v);
+}
+
+/* Get the calibration used for segment j of line i. */
+static float
+table_calibration (const ChangeMapBatch *batch, size_t i, size_t j)
+{
+  if (batch->calibrations) return batch->calibrations[batch->offsets[i] + j];
+  return batch->calibration;
+}
+
+/* Get the value of column for segment j of line i, as raw bits. */
+static uint32_t
+table_value (const ChangeMapBatch *batch, int column, size_t i, size_t j)
+{
+  int row, col;
+  float f;
+  uint32_t v;
+
+  switch (column) {
+  case COLUMN_LINE:
+    return batch->selection ? batch->selection[i] : i;
+  case COLUMN_ROW:
+  case COLUMN_COL:
+    change_map_batch_get_pixel (batch, i, j, &row, &col);
+    return (column == COLUMN_ROW) ? row : col;
+  case COLUMN_CHANGE:
+    f = batch->change[batch->offsets[i] + j];
+    break;
+  case COLUMN_CALIBRATION:
+    f = table_calibration (batch, i, j);
+    break;
+  default:
+    g_assert_not_reached ();
+  }
+  memcpy (&v, &f, 4);
+  return v;
+}
+
+static void
+export_table_binary (const ChangeMapBatch *batch, OutputOptions *cfg, FILE *fp)
+{
+  size_t N = batch->n_segments;
+  size_t column_size = (4 * N + 7) & ~(size_t) 7;
+  uint8_t header[TABLE_HEADER_SIZE] = {0};
+  uint8_t buf[4 * TABLE_BUFFER_SIZE];
+
+  double calibration = batch->calibration;
+  uint64_t calibration_bits;
+  memcpy (&calibration_bits, &calibration, 8);
+
+  memcpy (header, TABLE_MAGIC, 8);
+  put_uint32 (header + 8, TABLE_VERSION);
+  put_uint32 (header + 12, N_COLUMNS);
+  put_uint64 (header + 16, N);
+  put_uint32 (header + 24, cfg->height);
+  put_uint32 (header + 28, cfg->width);
+  put_uint32 (header + 32, cfg->origin_row);
+  put_uint32 (header + 36, cfg->origin_col);
+  put_uint64 (header + 40, calibration_bits);
+  for (int k = 0; k < N_COLUMNS; k++) {
+    put_uint64 (header + 48 + 8*k, TABLE_HEADER_SIZE + k * column_size);
+  }
+  table_write_check (header, TABLE_HEADER_SIZE, fp, cfg->filename);
+
+  for (int k = 0; k < N_COLUMNS; k++) {
+    size_t n = 0;
+    for (size_t i = 0; i < batch->n_lines; i++) {
+      size_t n_segments = batch->offsets[i+1] - batch->offsets[i];
+      for (size_t j = 0; j < n_segments; j++) {
+        put_uint32 (buf + 4*n, table_value (batch, k, i, j));
+        if (++n == TABLE_BUFFER_SIZE) {
+          table_write_check (buf, 4*n, fp, cfg->filename);
+          n = 0;
+        }
+      }
+    }
+    /* Pad column to 8 bytes */
+    if (N % 2) put_uint32 (buf + 4*n++, 0);
+    table_write_check (buf, 4*n, fp, cfg->filename);
+  }
+}
+
+static void
+export_table_csv (const ChangeMapBatch *batch, OutputOptions *cfg, FILE *fp)
+{
+  fprintf (fp, "line,row,col,change,calibration\n");
+  for (size_t i = 0; i < batch->n_lines; i++) {
+    size_t n_segments = batch->offsets[i+1] - batch->offsets[i];
+    uint32_t line = table_value (batch, COLUMN_LINE, i, 0);
+    for (size_t j = 0; j < n_segments; j++) {
+      int row, col;
+      change_map_batch_get_pixel (batch, i, j, &row, &col);
+      fprintf (fp, "%u,%i,%i,%.9g,%.9g\n", line, row, col,
+               batch->change[batch->offsets[i] + j],
+               table_calibration (batch, i, j));
+    }
+  }
+}
+
+/* ================================================================
+ * API functions
+ * ================================================================ */
+
+/* Write the change for every segment in batch to a table, either in
+ * the binary column format described above (FORMAT_TABLE) or as CSV
+ * (FORMAT_CSV). */
+void
+export_change_table (const ChangeMapBatch *batch, OutputOptions *cfg)
+{
+  g_assert (batch);
+  g_assert (cfg);
+
+  FILE *fp = fopen (cfg->filename, (cfg->format == FORMAT_CSV) ? "w" : "wb");
+  if (fp == NULL) {
+    fprintf (stderr, "ERROR: Could not write to '%s': %s.\n",
+             cfg->filename, strerror (errno));
+    exit (4);
+  }
+
+  switch (cfg->format) {
+  case FORMAT_TABLE:
+    export_table_binary (batch, cfg, fp);
+    break;
+  case FORMAT_CSV:
+    export_table_csv (batch, cfg, fp);
+    break;
+  default:
+    g_assert_not_reached ();
+  }
+
+  if (ferror (fp) | fclose (fp)) {
+    fprintf (stderr, "ERROR: Could not write to '%s': %s.\n",
+             cfg->filename, strerror (errno));
+    exit (4);
+  }
+}
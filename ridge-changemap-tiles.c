@@ -0,0 +1,208 @@
+/*
+ * Surrey Space Centre urban change detection tool for SAR
+ * Copyright (C) 2013 Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include <glib.h>
+
+#include <ridgeio.h>
+#include <ridgeutil.h>
+
+#include "ridge-changemap.h"
+
+/* The tile pyramid is written as OUTFILE/z/x/y.png, with 256x256
+ * tiles, in the layout used by slippy-map viewers.  At the deepest
+ * zoom level, one tile pixel is one image pixel; each coarser level
+ * halves the resolution, down to level 0, which is a single tile.
+ *
+ * Each level is rendered from a list of ridge pixels sorted by tile,
+ * and then by position within the tile.  The deepest level is built
+ * from the ridge pixels in the batch, and each coarser level from the
+ * level below it, by halving the pixel coordinates and keeping the
+ * maximum change wherever several pixels merge.  Tiles are rendered
+ * in parallel, and tiles with no ridge pixels are not written. */
+
+#define TILE_BITS 8
+#define TILE_SIZE (1 << TILE_BITS)
+
+typedef struct _TileLevel TileLevel;
+struct _TileLevel {
+  OutputOptions *cfg;
+  int zoom;
+  const RidgePixel *pixels;
+  const size_t *tile_start; /* Array of length n_tiles+1 */
+};
+
+static int
+tile_pixel_compare (const void *a, const void *b)
+{
+  const RidgePixel *p = (const RidgePixel *) a;
+  const RidgePixel *q = (const RidgePixel *) b;
+  uint32_t p_key[4] = {p->row >> TILE_BITS, p->col >> TILE_BITS, p->row, p->col};
+  uint32_t q_key[4] = {q->row >> TILE_BITS, q->col >> TILE_BITS, q->row, q->col};
+  for (int i = 0; i < 4; i++) {
+    if (p_key[i] != q_key[i]) return (p_key[i] < q_key[i]) ? -1 : 1;
+  }
+  return 0;
+}
+
+/* Sort n pixels by tile, and merge pixels at the same position,
+ * keeping the maximum change.  Returns the number of pixels left. */
+static size_t
+tile_pixels_sort (RidgePixel *pixels, size_t n)
+{
+  if (n == 0) return 0;
+  qsort (pixels, n, sizeof (RidgePixel), tile_pixel_compare);
+
+  size_t m = 0;
+  for (size_t i = 1; i < n; i++) {
+    if (pixels[i].row == pixels[m].row && pixels[i].col == pixels[m].col) {
+      /* fmaxf() ignores NaN */
+      pixels[m].change = fmaxf (pixels[m].change, pixels[i].change);
+    } else {
+      pixels[++m] = pixels[i];
+    }
+  }
+  return m + 1;
+}
+
+static int
+same_tile (const RidgePixel *p, const RidgePixel *q)
+{
+  return ((p->row >> TILE_BITS) == (q->row >> TILE_BITS)
+          && (p->col >> TILE_BITS) == (q->col >> TILE_BITS));
+}
+
+static void
+tile_render_range (size_t start, size_t end, void *user_data)
+{
+  TileLevel *level = (TileLevel *) user_data;
+  const Palette *palette = level->cfg->palette;
+  uint32_t *buf = g_new (uint32_t, TILE_SIZE * TILE_SIZE);
+
+  for (size_t t = start; t < end; t++) {
+    const RidgePixel *first = &level->pixels[level->tile_start[t]];
+    const RidgePixel *last = &level->pixels[level->tile_start[t+1]];
+    uint32_t tile_row = first->row >> TILE_BITS;
+    uint32_t tile_col = first->col >> TILE_BITS;
+
+    for (size_t i = 0; i < TILE_SIZE * TILE_SIZE; i++) {
+      buf[i] = palette->background;
+    }
+    for (const RidgePixel *p = first; p < last; p++) {
+      buf[(p->row & (TILE_SIZE - 1)) * TILE_SIZE + (p->col & (TILE_SIZE - 1))] =
+        palette_lookup (palette, p->change);
+    }
+
+    char *filename = g_strdup_printf ("%s/%i/%u/%u.png", level->cfg->filename,
+                                      level->zoom, tile_col, tile_row);
+    PngWriter *writer = png_writer_open (filename, TILE_SIZE, TILE_SIZE);
+    png_writer_write_rows (writer, buf, TILE_SIZE, TILE_SIZE);
+    png_writer_close (writer);
+    g_free (filename);
+  }
+
+  g_free (buf);
+}
+
+static void
+tile_mkdir_check (const char *dirname)
+{
+  if (g_mkdir_with_parents (dirname, 0777) != 0) {
+    fprintf (stderr, "ERROR: Could not create directory '%s': %s.\n",
+             dirname, strerror (errno));
+    exit (4);
+  }
+}
+
+/* ================================================================
+ * API functions
+ * ================================================================ */
+
+/* Write a z/x/y tile pyramid of the ridge mask into the directory
+ * cfg->filename. */
+void
+export_tile_pyramid (const ChangeMapBatch *batch, OutputOptions *cfg)
+{
+  g_assert (batch);
+  g_assert (cfg);
+  g_assert (cfg->palette);
+
+  /* Find the zoom level at which tiles have full resolution */
+  int max_zoom = 0;
+  while (((size_t) TILE_SIZE << max_zoom) < MAX (cfg->height, cfg->width)) {
+    max_zoom++;
+  }
+
+  size_t *band_start;
+  RidgePixel *pixels = ridge_pixels_bucket (batch, cfg->origin_row,
+                                            cfg->origin_col,
+                                            cfg->height, cfg->width,
+                                            MAX (cfg->height, 1), &band_start);
+  size_t n = tile_pixels_sort (pixels, band_start[1]);
+  g_free (band_start);
+
+  for (int zoom = max_zoom; zoom >= 0; zoom--) {
+    if (zoom < max_zoom) {
+      for (size_t i = 0; i < n; i++) {
+        pixels[i].row >>= 1;
+        pixels[i].col >>= 1;
+      }
+      n = tile_pixels_sort (pixels, n);
+    }
+
+    /* Index tiles, and create a directory for each tile column */
+    GArray *tile_start = g_array_new (FALSE, FALSE, sizeof (size_t));
+    for (size_t i = 0; i < n; i++) {
+      if (i == 0 || !same_tile (&pixels[i], &pixels[i-1])) {
+        g_array_append_val (tile_start, i);
+      }
+    }
+    g_array_append_val (tile_start, n);
+
+    size_t n_tiles = tile_start->len - 1;
+    uint8_t *have_dir = g_new0 (uint8_t, (size_t) 1 << zoom);
+    for (size_t t = 0; t < n_tiles; t++) {
+      uint32_t x = pixels[g_array_index (tile_start, size_t, t)].col >> TILE_BITS;
+      if (have_dir[x]) continue;
+      char *dirname = g_strdup_printf ("%s/%i/%u", cfg->filename, zoom, x);
+      tile_mkdir_check (dirname);
+      g_free (dirname);
+      have_dir[x] = TRUE;
+    }
+    g_free (have_dir);
+
+    /* Render tiles */
+    TileLevel level;
+    level.cfg = cfg;
+    level.zoom = zoom;
+    level.pixels = pixels;
+    level.tile_start = (const size_t *) tile_start->data;
+    parallel_for_stealing (cfg->threads, n_tiles, 1, tile_render_range, &level);
+
+    g_array_free (tile_start, TRUE);
+  }
+
+  g_free (pixels);
+}
@@ -0,0 +1,214 @@
+/*
+ * Surrey Space Centre urban change detection tool for SAR
+ * Copyright (C) 2013 Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include <glib.h>
+#include <ridgeio.h>
+#include <ridgeutil.h>
+
+#include "ridge-changemap.h"
+
+/* SVG and GeoJSON ridge line output is written directly with stdio,
+ * one line at a time, rather than being built up as a document in
+ * memory (as cairo does).
+ *
+ * In SVG output, runs of consecutive segments with the same colour are
+ * drawn as a single polyline.  In GeoJSON output, each ridge line is a
+ * LineString feature, with the change for each segment listed in its
+ * "change" property (null where the change is undefined).  GeoJSON
+ * coordinates are in pixels, with x = column and y = -row, so that
+ * features appear the right way up in GIS tools and line up with an
+ * un-georeferenced raster of the input image. */
+
+#define VECTOR_BUFFER_SIZE (1 << 16)
+
+typedef struct _VectorWriter VectorWriter;
+struct _VectorWriter {
+  FILE *fp;
+  OutputOptions *cfg;
+  size_t n_written;
+};
+
+static void
+vector_print_point (VectorWriter *w, const char *fmt, uint32_t row,
+                    uint32_t col)
+{
+  fprintf (w->fp, fmt, col / 128.0, row / 128.0);
+}
+
+static void
+vector_begin (VectorWriter *w, OutputOptions *cfg)
+{
+  w->cfg = cfg;
+  w->n_written = 0;
+  w->fp = fopen (cfg->filename, "w");
+  if (w->fp == NULL) {
+    fprintf (stderr, "ERROR: Could not write to '%s': %s.\n",
+             cfg->filename, strerror (errno));
+    exit (4);
+  }
+  setvbuf (w->fp, NULL, _IOFBF, VECTOR_BUFFER_SIZE);
+
+  switch (cfg->format) {
+  case FORMAT_SVG:
+    fprintf (w->fp,
+             "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+             "<svg xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\"\n"
+             "     width=\"%zu\" height=\"%zu\" viewBox=\"%zu %zu %zu %zu\">\n"
+             "<rect x=\"%zu\" y=\"%zu\" width=\"100%%\" height=\"100%%\""
+             " fill=\"#%06x\"/>\n"
+             "<g fill=\"none\" stroke-width=\"1\" stroke-linecap=\"round\""
+             " stroke-linejoin=\"round\">\n",
+             cfg->width, cfg->height, cfg->origin_col, cfg->origin_row,
+             cfg->width, cfg->height, cfg->origin_col, cfg->origin_row,
+             cfg->palette->background);
+    break;
+
+  case FORMAT_GEOJSON:
+    fprintf (w->fp, "{\"type\":\"FeatureCollection\",\"features\":[\n");
+    break;
+
+  default:
+    g_assert_not_reached ();
+  }
+}
+
+/* Write a ridge line with n_segments segments, where point i is at
+ * (rows[i], cols[i]) and segment i has change change[i].  index is the
+ * line's index in the ridge data, whether or not a selection is used. */
+static void
+vector_add_line (VectorWriter *w, size_t index, size_t n_segments,
+                 const uint32_t *rows, const uint32_t *cols,
+                 const float *change)
+{
+  switch (w->cfg->format) {
+  case FORMAT_SVG:
+    for (size_t j = 0; j < n_segments; j++) {
+      uint32_t colour = palette_lookup (w->cfg->palette, change[j]);
+      if (j == 0
+          || colour != palette_lookup (w->cfg->palette, change[j-1])) {
+        if (j > 0) fprintf (w->fp, "\"/>\n");
+        fprintf (w->fp, "<path stroke=\"#%06x\" d=\"M", colour);
+        vector_print_point (w, "%.12g %.12g", rows[j], cols[j]);
+      }
+      vector_print_point (w, " %.12g %.12g", rows[j+1], cols[j+1]);
+    }
+    if (n_segments > 0) fprintf (w->fp, "\"/>\n");
+    break;
+
+  case FORMAT_GEOJSON:
+    fprintf (w->fp, "%s{\"type\":\"Feature\",\"properties\":{\"line\":%zu,"
+             "\"change\":[", (w->n_written > 0) ? ",\n" : "", index);
+    for (size_t j = 0; j < n_segments; j++) {
+      if (j > 0) fputc (',', w->fp);
+      if (isfinite (change[j])) {
+        fprintf (w->fp, "%.9g", change[j]);
+      } else {
+        fprintf (w->fp, "null");
+      }
+    }
+    fprintf (w->fp, "]},\"geometry\":{\"type\":\"LineString\","
+             "\"coordinates\":[");
+    for (size_t j = 0; j <= n_segments; j++) {
+      if (j > 0) fputc (',', w->fp);
+      vector_print_point (w, "[%.12g,-%.12g]", rows[j], cols[j]);
+    }
+    fprintf (w->fp, "]}}");
+    break;
+
+  default:
+    g_assert_not_reached ();
+  }
+  w->n_written++;
+}
+
+static void
+vector_end (VectorWriter *w)
+{
+  switch (w->cfg->format) {
+  case FORMAT_SVG:
+    fprintf (w->fp, "</g>\n</svg>\n");
+    break;
+  case FORMAT_GEOJSON:
+    fprintf (w->fp, "\n]}\n");
+    break;
+  default:
+    g_assert_not_reached ();
+  }
+
+  if (ferror (w->fp) | fclose (w->fp)) {
+    fprintf (stderr, "ERROR: Could not write to '%s': %s.\n",
+             w->cfg->filename, strerror (errno));
+    exit (4);
+  }
+}
+
+/* ================================================================
+ * API functions
+ * ================================================================ */
+
+/* Write ridge lines from a batch of results in a vector format. */
+void
+export_ridge_lines_vector (const ChangeMapBatch *batch, OutputOptions *cfg)
+{
+  g_assert (batch);
+  g_assert (cfg);
+  g_assert (cfg->palette);
+
+  VectorWriter w;
+  vector_begin (&w, cfg);
+  for (size_t i = 0; i < batch->n_lines; i++) {
+    size_t first = batch->offsets[i];
+    size_t index = batch->selection ? batch->selection[i] : i;
+    vector_add_line (&w, index, batch->offsets[i+1] - first,
+                     batch->coords[0] + first + i,
+                     batch->coords[1] + first + i,
+                     batch->change + first);
+  }
+  vector_end (&w);
+}
+
+/* Write ridge lines in a vector format, calculating the change for each
+ * line just before it is written.  Only one line is held in memory at a
+ * time. */
+void
+export_ridge_lines_stream (ChangeMap *map, OutputOptions *cfg)
+{
+  g_assert (map);
+  g_assert (cfg);
+  g_assert (cfg->palette);
+
+  VectorWriter w;
+  vector_begin (&w, cfg);
+  size_t n_lines = change_map_get_num_lines (map);
+  for (size_t i = 0; i < n_lines; i++) {
+    ChangeMapLine *line = change_map_get_line (map, i);
+    size_t index = map->selection ? map->selection[i] : i;
+    vector_add_line (&w, index, line->n_segments, line->coords[0],
+                     line->coords[1], line->change);
+    change_map_line_free (line);
+  }
+  vector_end (&w);
+}
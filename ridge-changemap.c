@@ -33,22 +33,44 @@
 #include "ridge-changemap.h"
 
 #define DEFAULT_CLASS_LABEL 1
+#define DEFAULT_MEMORY_BUDGET 256 /* MiB */
+#define DEFAULT_IN_FLIGHT 3
+#define DEFAULT_TRIM 0.1 /* Fraction trimmed from each end */
 
 enum OutputMode {
   MODE_RIDGE_LINES,
   MODE_RIDGE_MASK,
+  MODE_TABLE,
+  MODE_TILES,
 };
 
 /* -------------------------------------------------------------------- */
 
-#define GETOPT_OPTIONS "c:hi:m:"
+#define GETOPT_OPTIONS "b:B:c:Chi:j:k:m:M:n:p:R:STw:z"
 
 struct option long_options[] =
   {
+    {"batch", 1, 0, 'b'},
+    {"bins", 1, 0, 'B'},
+    {"cache", 0, 0, 'C'},
+    {"calibration", 1, 0, 'k'},
     {"class", 1, 0, 'c'},
+    {"compact", 0, 0, 'K'},
     {"help", 0, 0, 'h'},
+    {"threads", 1, 0, 'j'},
+    {"deflate", 0, 0, 'z'},
+    {"estimator", 1, 0, 'E'},
     {"mode", 1, 0, 'm'},
+    {"memory", 1, 0, 'M'},
     {"nan", 1, 0, 'i'},
+    {"palette", 1, 0, 'p'},
+    {"profile", 2, 0, 'P'},
+    {"in-flight", 1, 0, 'n'},
+    {"local-window", 1, 0, 'L'},
+    {"series", 0, 0, 'T'},
+    {"stream", 0, 0, 'S'},
+    {"stripe-rows", 1, 0, 'R'},
+    {"window", 1, 0, 'w'},
     {0, 0, 0, 0} /* Guard */
   };
 
@@ -57,48 +79,105 @@ usage (char *name, int status)
 {
   printf (
 "Usage: %s [OPTION ...] [-m MODE] CRDG PRE POST OUTFILE\n"
+"   or: %s [OPTION ...] [-m MODE] -T CRDG PRE POST... OUTFILE\n"
+"   or: %s [OPTION ...] [-m MODE] -b MANIFEST\n"
 "\n"
 "Modes:\n"
 "  ridgelines      Draw vector features coloured by change\n"
 "  ridgemask       Draw masked ratio image coloured by change\n"
+"  table           Write change for each segment as a binary table, or as\n"
+"                  CSV if OUTFILE ends in '.csv'\n"
+"  tiles           Write a z/x/y pyramid of PNG tiles into directory OUTFILE\n"
 "\n"
 "Options:\n"
 "  -m, --mode=MODE Set changemap rendering mode [ridgelines]\n"
-"  -c, --class=CLASS  Set class label to use for detection [%i]\n"
+"  -c, --class=CLASS[,CLASS...]  Set class labels to use for detection [%i]\n"
 "  -i, --nan=VAL   Set non-finite input values to VAL [default 0]\n"
+"  -p, --palette=FILE  Load colour palette from FILE\n"
+"  -B, --bins=K    Draw ridge lines using K colours [unlimited]\n"
+"  -z, --deflate   Compress TIFF output\n"
+"  -R, --stripe-rows=N  Render PNG output in stripes of N rows\n"
+"  -w, --window=ROW,COL,H,W  Only process the H x W window at (ROW, COL)\n"
+"  -j, --threads=N Use N threads [number of CPUs]\n"
+"  -S, --stream    Read images row by row instead of loading them\n"
+"  -M, --memory=MB Limit image buffers to MB MiB in stream mode [%i]\n"
+"      --compact   Hold images in memory at 16 bits per pixel\n"
+"  -C, --cache     Cache calibration values alongside POST\n"
+"  -k, --calibration=VALUE  Use VALUE as the global calibration\n"
+"      --estimator=EST  Calibrate using EST of the square ratios: 'mean',\n"
+"                  'median', 'quantile:Q' or 'trimmed[:F]' [mean]\n"
+"      --local-window=N  Calibrate each pixel over the N x N window\n"
+"                  around it instead of the whole image\n"
+"  -T, --series    Compare PRE with a series of post-event images\n"
+"  -b, --batch=MANIFEST  Run the jobs listed in MANIFEST\n"
+"  -n, --in-flight=N  Keep at most N batch jobs in memory [%i]\n"
+"      --profile[=FILE]  Report time and memory used by each phase on\n"
+"                  stderr, or as JSON in FILE\n"
 "  -h, --help      Display this message and exit\n"
 "\n"
 "Generates a change map using a pre-event SAR amplitude image PRE, a\n"
 "post-event image POST, and a classified ridge data file CRDG.  Output\n"
-"is generated in OUTFILE.  All images should be single-channel 32-bit\n"
-"floating point TIFF files.\n"
+"is generated in OUTFILE, in PDF, PNG, SVG or GeoJSON format according\n"
+"to its suffix.  In ridgemask mode, a TIFF OUTFILE receives the raw\n"
+"change values, with NaN away from ridges.  All input images should be\n"
+"single-channel 32-bit floating point TIFF files.  If several class\n"
+"labels are given, one output file is generated for each, and '%%c' in\n"
+"OUTFILE is replaced with the class label.  Similarly, in series mode,\n"
+"one output file is generated for each post-event image, and '%%e' in\n"
+"OUTFILE is replaced with its position in the series, starting from 1.\n"
+"\n"
+"If a window is given, only the ridge lines that overlap it are\n"
+"processed, only the window is read from each image, and the output\n"
+"covers only the window.  Unless a calibration value is given or\n"
+"cached, the images are calibrated over the window.\n"
+"\n"
+"In batch mode, each line of MANIFEST gives the CRDG, PRE, POST and\n"
+"OUTFILE arguments for one job, separated by whitespace.  Loading,\n"
+"change detection and output for successive jobs are overlapped.\n"
+"\n"
+"Setting RIDGE_CHANGEMAP_PROFILE in the environment is equivalent to\n"
+"--profile=VALUE, or to --profile if its value is empty or '1'.\n"
 "\n"
 "Please report bugs to %s.\n",
-name, DEFAULT_CLASS_LABEL, PACKAGE_BUGREPORT);
+name, name, name, DEFAULT_CLASS_LABEL, DEFAULT_MEMORY_BUDGET,
+DEFAULT_IN_FLIGHT, PACKAGE_BUGREPORT);
   exit (status);
 }
 
 /* -------------------------------------------------------------------------- */
 
+/* Load ridge data from crdg_fn.  If the data is classified, the
+ * indices of the lines with each of the n_classes requested class
+ * labels are returned in *selection (which should be freed with
+ * g_free()), with the lines for class_labels[k] running from
+ * class_start[k] to class_start[k+1]-1.  Otherwise, *selection is set
+ * to NULL and all lines should be used for every class.  On failure,
+ * an error message is printed and NULL is returned. */
 static RioData *
-ridges_load_check (const char *crdg_fn, int class_label,
-                   uint32_t *height, uint32_t *width)
+ridges_load (const char *crdg_fn,
+             const uint8_t *class_labels, int n_classes,
+             uint32_t *height, uint32_t *width,
+             uint32_t **selection, size_t *class_start)
 {
   g_assert (crdg_fn);
+  g_assert (class_labels);
   g_assert (height);
   g_assert (width);
+  g_assert (selection);
+  g_assert (class_start);
 
   RioData *data = rio_data_from_file (crdg_fn);
   if (data == NULL) {
     fprintf (stderr, "ERROR: Failed to load ridge data from '%s': %s.\n",
              crdg_fn, strerror (errno));
-    exit (2);
+    return NULL;
   }
 
   if (rio_data_get_type (data) != RIO_DATA_LINES) {
     fprintf (stderr, "ERROR: '%s' does not contain ridge line data.\n",
              crdg_fn);
-    exit (2);
+    rio_data_destroy (data);
+    return NULL;
   }
 
   /* Determine original image height & width */
@@ -106,7 +185,8 @@ ridges_load_check (const char *crdg_fn, int class_label,
         && rio_data_get_metadata_uint32 (data, RIO_KEY_IMAGE_COLS, width))) {
     fprintf (stderr, "ERROR: '%s' contains invalid image size metadata.\n",
              crdg_fn);
-    exit (2);
+    rio_data_destroy (data);
+    return NULL;
   }
 
   size_t N = rio_data_get_num_entries (data);
@@ -120,50 +200,323 @@ ridges_load_check (const char *crdg_fn, int class_label,
     fprintf (stderr, "WARNING: '%s' contains invalid classification metadata.\n",
              crdg_fn);
 
-    /* If no classification data is present, just return the original
+    /* If no classification data is present, just use the original
      * ridge data set. */
+    *selection = NULL;
+    for (int k = 0; k <= n_classes; k++) class_start[k] = 0;
     return data;
   }
 
-  /* Create a new ridge data set, and copy over all of the features
-   * that have the correct class label. */
-  RioData *data_c = rio_data_new (RIO_DATA_LINES);
-  rio_data_set_metadata_uint32 (data_c, RIO_KEY_IMAGE_ROWS, *height);
-  rio_data_set_metadata_uint32 (data_c, RIO_KEY_IMAGE_COLS, *width);
-  for (int i = 0; i < N; i++) {
-    if (classification[i] != class_label) continue;
-
-    RioLine *l = rio_data_get_line (data, i);
-    RioLine *l_c = rio_data_new_line (data_c);
-    int M = rio_line_get_length (l);
-    for (int j = 0; j < M; j++) {
-      RioPoint *p = rio_line_get_point (l, j);
-      RioPoint *p_c = rio_line_new_point (l_c);
-      memcpy (p_c, p, sizeof(RioPoint));
-    }
+  /* Partition the features by class label, without copying them,
+   * using a counting sort. */
+  int class_index[256];
+  size_t counts[256] = {0};
+  for (int i = 0; i < 256; i++) class_index[i] = -1;
+  for (int k = 0; k < n_classes; k++) class_index[class_labels[k]] = k;
+
+  for (size_t i = 0; i < N; i++) counts[classification[i]]++;
+
+  size_t fill[256];
+  class_start[0] = 0;
+  for (int k = 0; k < n_classes; k++) {
+    fill[k] = class_start[k];
+    class_start[k+1] = class_start[k] + counts[class_labels[k]];
   }
 
-  rio_data_destroy (data);
-  return data_c;
+  *selection = g_new (uint32_t, MAX (class_start[n_classes], 1));
+  for (size_t i = 0; i < N; i++) {
+    int k = class_index[classification[i]];
+    if (k >= 0) (*selection)[fill[k]++] = i;
+  }
+
+  return data;
 }
 
-static RutSurface *
-img_load_check (const char *fn, uint32_t rows, uint32_t cols)
+static RioData *
+ridges_load_check (const char *crdg_fn,
+                   const uint8_t *class_labels, int n_classes,
+                   uint32_t *height, uint32_t *width,
+                   uint32_t **selection, size_t *class_start)
 {
-  RutSurface *img = rut_surface_from_tiff (fn);
+  RioData *data = ridges_load (crdg_fn, class_labels, n_classes,
+                               height, width, selection, class_start);
+  if (data == NULL) exit (2);
+  return data;
+}
+
+/* Open the image in fn for streaming, checking that it has rows x
+ * cols pixels and that decoding one of its strips needs at most
+ * budget bytes.  On failure, an error message is printed and NULL is
+ * returned. */
+static StreamImage *
+stream_load (const char *fn, uint32_t rows, uint32_t cols, size_t budget)
+{
+  uint32_t img_rows, img_cols;
+  StreamImage *img = stream_image_open (fn);
   if (img == NULL) {
-    fprintf (stderr, "ERROR: Failed to load TIFF from '%s'.\n", fn);
-    exit (3);
+    fprintf (stderr, "ERROR: Failed to open TIFF '%s' for streaming.\n", fn);
+    return NULL;
   }
   /* Check size */
-  if (img->rows != rows || img->cols != cols) {
+  stream_image_get_size (img, &img_rows, &img_cols);
+  if (img_rows != rows || img_cols != cols) {
     fprintf (stderr, "ERROR: Bad image size for '%s' (expected %ux%u).\n", fn,
              rows, cols);
-    exit (3);
+    stream_image_close (img);
+    return NULL;
+  }
+  size_t strip_size = stream_image_get_strip_size (img);
+  if (strip_size > budget) {
+    fprintf (stderr, "ERROR: Decoding a strip of '%s' needs %zu MiB, which is\n"
+             "more than the memory budget set by -M.\n", fn,
+             (strip_size + 0xfffff) >> 20);
+    stream_image_close (img);
+    return NULL;
+  }
+  return img;
+}
+
+static StreamImage *
+stream_load_check (const char *fn, uint32_t rows, uint32_t cols,
+                   size_t budget)
+{
+  StreamImage *img = stream_load (fn, rows, cols, budget);
+  if (img == NULL) exit (3);
+  return img;
+}
+
+/* Load the image from fn, checking that it has rows x cols pixels.
+ * If window is non-NULL, only the window it describes (as ROW, COL,
+ * HEIGHT, WIDTH) is loaded, using at most budget bytes to decode
+ * compressed strips.  On failure, an error message is printed and
+ * NULL is returned. */
+static RutSurface *
+img_load (const char *fn, uint32_t rows, uint32_t cols,
+          const uint32_t *window, size_t budget)
+{
+  uint32_t img_rows, img_cols;
+  if (!image_get_tiff_size (fn, &img_rows, &img_cols)) {
+    fprintf (stderr, "ERROR: Failed to load TIFF from '%s'.\n", fn);
+    return NULL;
+  }
+  /* Check size before loading any pixel data */
+  if (img_rows != rows || img_cols != cols) {
+    fprintf (stderr, "ERROR: Bad image size for '%s' (expected %ux%u).\n", fn,
+             rows, cols);
+    return NULL;
+  }
+
+  if (window != NULL) {
+    StreamImage *s = stream_load (fn, rows, cols, budget);
+    if (s == NULL) return NULL;
+    RutSurface *img = stream_image_read_window (s, window[0], window[1],
+                                                window[2], window[3]);
+    stream_image_close (s);
+    if (img == NULL) {
+      fprintf (stderr, "ERROR: Failed to load TIFF from '%s'.\n", fn);
+      return NULL;
+    }
+    return img;
+  }
+
+  RutSurface *img = image_load_tiff (fn);
+  if (img == NULL) {
+    fprintf (stderr, "ERROR: Failed to load TIFF from '%s'.\n", fn);
+    return NULL;
+  }
+  g_assert (img->rows == rows && img->cols == cols);
+  return img;
+}
+
+static RutSurface *
+img_load_check (const char *fn, uint32_t rows, uint32_t cols,
+                const uint32_t *window, size_t budget)
+{
+  RutSurface *img = img_load (fn, rows, cols, window, budget);
+  if (img == NULL) exit (3);
+  return img;
+}
+
+/* Load an image into a compact image, checking that it has the
+ * expected size.  If window is non-NULL, only that window of the
+ * image is loaded.  At most budget bytes are used to decode
+ * compressed strips.  On failure, an error message is printed and
+ * NULL is returned. */
+static CompactImage *
+compact_load (const char *fn, uint32_t rows, uint32_t cols,
+              const uint32_t *window, size_t budget)
+{
+  StreamImage *s = stream_load (fn, rows, cols, budget);
+  if (s == NULL) return NULL;
+  CompactImage *img;
+  if (window != NULL) {
+    img = compact_image_read (s, window[0], window[1], window[2], window[3]);
+  } else {
+    img = compact_image_read (s, 0, 0, rows, cols);
+  }
+  stream_image_close (s);
+  if (img == NULL) {
+    fprintf (stderr, "ERROR: Failed to load TIFF from '%s'.\n", fn);
+    return NULL;
   }
   return img;
 }
 
+static CompactImage *
+compact_load_check (const char *fn, uint32_t rows, uint32_t cols,
+                    const uint32_t *window, size_t budget)
+{
+  CompactImage *img = compact_load (fn, rows, cols, window, budget);
+  if (img == NULL) exit (3);
+  return img;
+}
+
+/* Restrict the lines selected for each of the n_classes class labels
+ * (as returned by ridges_load_check()) to those that overlap window,
+ * using a spatial index over the ridge lines.  *selection is replaced
+ * with a new array, and class_start is updated. */
+static void
+select_window (RioData *ridges, uint32_t height, uint32_t width,
+               const uint32_t *window, int n_classes,
+               uint32_t **selection, size_t *class_start)
+{
+  RidgeIndex *index = ridge_index_new (ridges, height, width);
+  size_t n;
+  uint32_t *lines = ridge_index_query (index, window[0], window[1],
+                                       window[2], window[3], &n);
+  ridge_index_free (index);
+
+  /* Both lists are in increasing order, so merge them */
+  uint32_t *result = g_new (uint32_t, MAX (n * n_classes, 1));
+  size_t m = 0;
+  for (int k = 0; k < n_classes; k++) {
+    size_t start = m;
+    if (*selection == NULL) {
+      memcpy (result + m, lines, n * sizeof (uint32_t));
+      m += n;
+    } else {
+      const uint32_t *s = *selection;
+      size_t i = class_start[k], j = 0;
+      while (i < class_start[k+1] && j < n) {
+        if (s[i] < lines[j]) {
+          i++;
+        } else if (s[i] > lines[j]) {
+          j++;
+        } else {
+          result[m++] = s[i];
+          i++;
+          j++;
+        }
+      }
+    }
+    class_start[k] = start;
+  }
+  class_start[n_classes] = m;
+
+  g_free (lines);
+  g_free (*selection);
+  *selection = result;
+}
+
+/* Parse a comma-separated list of distinct class labels into labels.
+ * Returns the number of labels, or -1 if the list is invalid. */
+static int
+parse_class_labels (const char *arg, uint8_t *labels)
+{
+  int seen[256] = {0};
+  int n = 0;
+  char **tokens = g_strsplit (arg, ",", -1);
+  for (char **t = tokens; *t != NULL; t++) {
+    uint8_t label;
+    char extra;
+    if (sscanf (*t, "%hhu%c", &label, &extra) != 1 || seen[label]) {
+      n = -1;
+      break;
+    }
+    seen[label] = 1;
+    labels[n++] = label;
+  }
+  g_strfreev (tokens);
+  return n;
+}
+
+/* Parse a calibration estimator: "mean", "median", "quantile:Q" for
+ * 0 < Q < 1, or "trimmed[:F]" for a mean with a fraction 0 <= F < 0.5
+ * (by default DEFAULT_TRIM) of values discarded from each end.
+ * Returns FALSE if the estimator is invalid. */
+static int
+parse_estimator (const char *arg, int *estimator, double *param)
+{
+  char extra;
+  if (strcmp (arg, "mean") == 0) {
+    *estimator = ESTIMATOR_MEAN;
+    *param = 0;
+  } else if (strcmp (arg, "median") == 0) {
+    *estimator = ESTIMATOR_QUANTILE;
+    *param = 0.5;
+  } else if (strcmp (arg, "trimmed") == 0) {
+    *estimator = ESTIMATOR_TRIMMED;
+    *param = DEFAULT_TRIM;
+  } else if (sscanf (arg, "quantile:%lf%c", param, &extra) == 1) {
+    *estimator = ESTIMATOR_QUANTILE;
+    return (*param > 0 && *param < 1);
+  } else if (sscanf (arg, "trimmed:%lf%c", param, &extra) == 1) {
+    *estimator = ESTIMATOR_TRIMMED;
+    return (*param >= 0 && *param < 0.5);
+  } else {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* Check whether the output filename template tmpl contains the
+ * placeholder '%' followed by c, using the same escape rules as
+ * expand_output_filename(). */
+static int
+output_template_has (const char *tmpl, char c)
+{
+  for (const char *p = tmpl; *p != 0; p++) {
+    if (p[0] != '%') continue;
+    if (p[1] == c) return TRUE;
+    if (p[1] != 0) p++; /* Skip escaped character */
+  }
+  return FALSE;
+}
+
+/* Generate an output filename from tmpl, replacing "%c" with
+ * class_label, "%e" with epoch and "%%" with "%".  The result should
+ * be freed with g_free(). */
+static char *
+expand_output_filename (const char *tmpl, int class_label, int epoch)
+{
+  GString *result = g_string_new (NULL);
+  for (const char *p = tmpl; *p != 0; p++) {
+    if (p[0] == '%' && p[1] == 'c') {
+      g_string_append_printf (result, "%i", class_label);
+      p++;
+    } else if (p[0] == '%' && p[1] == 'e') {
+      g_string_append_printf (result, "%i", epoch);
+      p++;
+    } else if (p[0] == '%' && p[1] == '%') {
+      g_string_append_c (result, '%');
+      p++;
+    } else {
+      g_string_append_c (result, *p);
+    }
+  }
+  return g_string_free (result, FALSE);
+}
+
+/* Report the profile, if profiling is turned on.  Failure to write
+ * the report is not fatal. */
+static void
+profile_report_check (Profile *profile, const char *fn)
+{
+  if (!profile_report (profile, fn)) {
+    fprintf (stderr, "WARNING: Could not write profile to '%s'.\n", fn);
+  }
+}
+
 /* -------------------------------------------------------------------------- */
 
 int
@@ -176,6 +529,12 @@ guess_output_format (const char *filename)
   struct _FormatSuffix format_suffixes[] = {
     {"png", FORMAT_PNG},
     {"pdf", FORMAT_PDF},
+    {"svg", FORMAT_SVG},
+    {"geojson", FORMAT_GEOJSON},
+    {"json", FORMAT_GEOJSON},
+    {"csv", FORMAT_CSV},
+    {"tif", FORMAT_TIFF},
+    {"tiff", FORMAT_TIFF},
     {NULL, FORMAT_NONE},
   };
 
@@ -193,33 +552,551 @@ guess_output_format (const char *filename)
 
 /* -------------------------------------------------------------------------- */
 
+static void
+export_batch (int mode, const ChangeMapBatch *batch, OutputOptions *opts)
+{
+  switch (mode) {
+  case MODE_RIDGE_LINES:
+    export_ridge_lines (batch, opts);
+    break;
+  case MODE_RIDGE_MASK:
+    export_ridge_mask (batch, opts);
+    break;
+  case MODE_TABLE:
+    export_change_table (batch, opts);
+    break;
+  case MODE_TILES:
+    export_tile_pyramid (batch, opts);
+    break;
+  default:
+    g_assert_not_reached ();
+  };
+}
+
+/* Return format, or a format guessed from filename if it is
+ * FORMAT_NONE.  If the format can't be used with mode, an error
+ * message is printed and -1 is returned. */
+static int
+output_format (int mode, int format, const char *filename)
+{
+  /* Tiles are always PNG, in a directory */
+  if (mode == MODE_TILES) return FORMAT_PNG;
+
+  /* FIXME should be an explicit command-line option */
+  if (format == FORMAT_NONE) {
+    format = guess_output_format (filename);
+  }
+
+  /* Tables are binary unless CSV is requested */
+  if (mode == MODE_TABLE) {
+    return (format == FORMAT_CSV) ? FORMAT_CSV : FORMAT_TABLE;
+  }
+  if (format == FORMAT_CSV) {
+    fprintf (stderr, "ERROR: CSV output for '%s' is only available in table mode.\n",
+             filename);
+    return -1;
+  }
+
+  if (format == FORMAT_NONE) {
+    fprintf (stderr, "WARNING: Could not guess output format for '%s'. Using PDF.\n",
+             filename);
+    format = FORMAT_PDF;
+  }
+  if (mode == MODE_RIDGE_MASK
+      && (format == FORMAT_SVG || format == FORMAT_GEOJSON)) {
+    fprintf (stderr, "ERROR: Cannot write ridge mask to '%s' in a vector format.\n",
+             filename);
+    return -1;
+  }
+  if (mode == MODE_RIDGE_LINES && format == FORMAT_TIFF) {
+    fprintf (stderr, "ERROR: TIFF output for '%s' is only available in ridgemask mode.\n",
+             filename);
+    return -1;
+  }
+  return format;
+}
+
+static int
+output_format_check (int mode, int format, const char *filename)
+{
+  format = output_format (mode, format, filename);
+  if (format < 0) exit (1);
+  return format;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* In manifest mode, each line of the manifest file describes one job,
+ * with the same CRDG, PRE, POST and OUTFILE arguments as a normal
+ * run.  The jobs are run as a three-stage pipeline: one thread loads
+ * the input data for the next job, another calibrates and computes
+ * the change map for the current job, and the main thread renders and
+ * writes the output for the previous one.  Each job holds its input
+ * images until it has been written, so at most max_in_flight jobs
+ * exist at any time.  A job whose input data can't be loaded is
+ * reported and skipped without stopping the other jobs. */
+
+typedef struct _ManifestConfig ManifestConfig;
+struct _ManifestConfig {
+  int mode;
+  const uint8_t *classes;
+  int n_classes;
+  double nan_val;
+  int threads;
+  int cache;
+  double calibration;
+  int estimator;
+  double estimator_param;
+  int local_radius;
+  int compact;
+  size_t budget;
+  int format;
+  const Palette *palette;
+  int colour_bins;
+  int compress;
+  int stripe_rows;
+  Profile *profile; /* May be NULL */
+};
+
+typedef struct _Job Job;
+struct _Job {
+  int line; /* Line number in manifest, for messages */
+  char *crdg_fn, *pre_fn, *post_fn, *out_fn;
+  int status; /* Non-zero exit status if the job failed */
+  int format[256]; /* Output format for each class label */
+
+  uint32_t height, width;
+  RioData *ridges;
+  uint32_t *selection;
+  size_t class_start[257];
+  RutSurface *pre, *post;
+  CompactImage *pre_compact, *post_compact;
+  char *cache_fn, *cache_key;
+
+  ChangeMap *changes;
+  ChangeMapBatch **batches; /* One per class label */
+};
+
+typedef struct _Pipeline Pipeline;
+struct _Pipeline {
+  const ManifestConfig *cfg;
+  GPtrArray *jobs;
+  GAsyncQueue *slots;    /* Tokens limiting the number of jobs in flight */
+  GAsyncQueue *loaded;   /* Jobs waiting to be computed */
+  GAsyncQueue *computed; /* Jobs waiting to be written */
+};
+
+/* Marks the end of a pipeline queue, since NULL can't be queued. */
+static Job pipeline_end;
+
+/* Parse the manifest file fn.  Blank lines and lines starting with
+ * '#' are ignored.  Each OUTFILE must contain '%c' if there is more
+ * than one class label, and its output files must have formats that
+ * can be used with cfg->mode, so that a bad manifest is rejected
+ * before any job is run.  Returns an array of Job structures, which
+ * should be freed with job_free(). */
+static GPtrArray *
+manifest_load_check (const char *fn, const ManifestConfig *cfg)
+{
+  char *contents;
+  GError *err = NULL;
+  if (!g_file_get_contents (fn, &contents, NULL, &err)) {
+    fprintf (stderr, "ERROR: Failed to load manifest from '%s': %s.\n",
+             fn, err->message);
+    exit (1);
+  }
+
+  GPtrArray *jobs = g_ptr_array_new ();
+  char **lines = g_strsplit (contents, "\n", -1);
+  for (int i = 0; lines[i] != NULL; i++) {
+    char *line = g_strstrip (lines[i]);
+    if (line[0] == 0 || line[0] == '#') continue;
+
+    char *fields[4];
+    int n_fields = 0;
+    char **tokens = g_strsplit_set (line, " \t", -1);
+    for (char **t = tokens; *t != NULL; t++) {
+      if (**t == 0) continue;
+      if (n_fields == 4) {
+        n_fields++;
+        break;
+      }
+      fields[n_fields++] = *t;
+    }
+    if (n_fields != 4) {
+      fprintf (stderr, "ERROR: %s:%i: Expected CRDG PRE POST OUTFILE.\n",
+               fn, i + 1);
+      g_strfreev (tokens);
+      g_strfreev (lines);
+      g_free (contents);
+      exit (1);
+    }
+    if (cfg->n_classes > 1 && !output_template_has (fields[3], 'c')) {
+      fprintf (stderr, "ERROR: %s:%i: OUTFILE must contain '%%c' when more than\n"
+               "one class label is specified.\n", fn, i + 1);
+      g_strfreev (tokens);
+      g_strfreev (lines);
+      g_free (contents);
+      exit (1);
+    }
+
+    Job *job = g_new0 (Job, 1);
+    for (int k = 0; k < cfg->n_classes; k++) {
+      char *out_fn = expand_output_filename (fields[3], cfg->classes[k], 1);
+      job->format[k] = output_format (cfg->mode, cfg->format, out_fn);
+      g_free (out_fn);
+      if (job->format[k] < 0) {
+        fprintf (stderr, "ERROR: %s:%i: Bad OUTFILE.\n", fn, i + 1);
+        g_free (job);
+        g_strfreev (tokens);
+        g_strfreev (lines);
+        g_free (contents);
+        exit (1);
+      }
+    }
+    job->line = i + 1;
+    job->crdg_fn = g_strdup (fields[0]);
+    job->pre_fn = g_strdup (fields[1]);
+    job->post_fn = g_strdup (fields[2]);
+    job->out_fn = g_strdup (fields[3]);
+    g_ptr_array_add (jobs, job);
+    g_strfreev (tokens);
+  }
+  g_strfreev (lines);
+  g_free (contents);
+  return jobs;
+}
+
+/* Free all of the data associated with a job, except its filenames. */
+static void
+job_release (Job *job, int n_classes)
+{
+  if (job->batches != NULL) {
+    for (int k = 0; k < n_classes; k++) change_map_batch_free (job->batches[k]);
+    g_free (job->batches);
+    job->batches = NULL;
+  }
+  change_map_free (job->changes);
+  job->changes = NULL;
+  if (job->ridges != NULL) rio_data_destroy (job->ridges);
+  job->ridges = NULL;
+  g_free (job->selection);
+  job->selection = NULL;
+  image_destroy (job->pre);
+  image_destroy (job->post);
+  job->pre = job->post = NULL;
+  compact_image_free (job->pre_compact);
+  compact_image_free (job->post_compact);
+  job->pre_compact = job->post_compact = NULL;
+  g_free (job->cache_fn);
+  g_free (job->cache_key);
+  job->cache_fn = job->cache_key = NULL;
+}
+
+static void
+job_free (Job *job)
+{
+  g_free (job->crdg_fn);
+  g_free (job->pre_fn);
+  g_free (job->post_fn);
+  g_free (job->out_fn);
+  g_free (job);
+}
+
+/* Stage 1: load the ridge data and images for a job.  If any of the
+ * input data can't be loaded, job->status is set and the job should
+ * not be computed or written. */
+static void
+job_load (const ManifestConfig *cfg, Job *job)
+{
+  job->changes = change_map_new ();
+  change_map_set_nan (job->changes, cfg->nan_val);
+  change_map_set_threads (job->changes, cfg->threads);
+  change_map_set_estimator (job->changes, cfg->estimator,
+                            cfg->estimator_param);
+  change_map_set_local_calibration (job->changes, cfg->local_radius);
+
+  ProfileTimer timer;
+  profile_start (cfg->profile, &timer);
+  job->ridges = ridges_load (job->crdg_fn, cfg->classes, cfg->n_classes,
+                             &job->height, &job->width,
+                             &job->selection, job->class_start);
+  if (job->ridges == NULL) {
+    job->status = 2;
+    return;
+  }
+  change_map_set_ridge_data (job->changes, job->ridges);
+  profile_stop (cfg->profile, &timer, "load_ridges",
+                rio_data_get_num_entries (job->ridges));
+
+  double calibration = cfg->calibration;
+  if (isnan (calibration) && cfg->cache) {
+    job->cache_fn = calibration_cache_filename (job->post_fn);
+    job->cache_key = calibration_cache_key (job->pre_fn, job->post_fn,
+                                            cfg->nan_val, cfg->estimator,
+                                            cfg->estimator_param,
+                                            cfg->compact);
+    if (job->cache_key != NULL
+        && calibration_cache_lookup (job->cache_fn, job->cache_key,
+                                     &calibration)) {
+      g_free (job->cache_key);
+      job->cache_key = NULL;
+    }
+  }
+
+  uint64_t n_pixels = (uint64_t) job->height * job->width;
+  profile_start (cfg->profile, &timer);
+  if (cfg->compact) {
+    job->pre_compact = compact_load (job->pre_fn, job->height,
+                                     job->width, NULL, cfg->budget);
+    job->post_compact = job->pre_compact == NULL ? NULL :
+      compact_load (job->post_fn, job->height, job->width, NULL,
+                    cfg->budget);
+    if (job->post_compact == NULL) {
+      job->status = 3;
+      return;
+    }
+    change_map_set_compact_images (job->changes, job->pre_compact,
+                                   job->post_compact);
+  } else {
+    job->pre = img_load (job->pre_fn, job->height, job->width, NULL,
+                         cfg->budget);
+    job->post = job->pre == NULL ? NULL :
+      img_load (job->post_fn, job->height, job->width, NULL, cfg->budget);
+    if (job->post == NULL) {
+      job->status = 3;
+      return;
+    }
+    change_map_set_pre_image (job->changes, job->pre);
+    change_map_set_post_image (job->changes, job->post);
+  }
+  profile_stop (cfg->profile, &timer, "load_images", 2 * n_pixels);
+  profile_count (cfg->profile, "pixels", 2 * n_pixels);
+
+  /* Setting the images discards any calibration, so the calibration
+   * value must be set afterwards. */
+  if (!isnan (calibration)) {
+    change_map_set_calibration (job->changes, calibration);
+  }
+}
+
+/* Stage 2: calibrate and compute the change map for each class. */
+static void
+job_compute (const ManifestConfig *cfg, Job *job)
+{
+  ProfileTimer timer;
+  uint64_t n_pixels = isnan (job->changes->calibration) ?
+    (uint64_t) job->height * job->width : 0;
+  double calibration = NAN;
+  if (cfg->local_radius == 0) {
+    profile_start (cfg->profile, &timer);
+    calibration = change_map_calibrate (job->changes);
+    profile_stop (cfg->profile, &timer, "calibrate", n_pixels);
+  }
+
+  if (job->cache_key != NULL
+      && !calibration_cache_store (job->cache_fn, job->cache_key,
+                                   calibration)) {
+    fprintf (stderr, "WARNING: Could not write calibration cache '%s'.\n",
+             job->cache_fn);
+  }
+
+  job->batches = g_new0 (ChangeMapBatch *, cfg->n_classes);
+  for (int k = 0; k < cfg->n_classes; k++) {
+    if (job->selection != NULL) {
+      change_map_set_line_selection (job->changes,
+                                     job->selection + job->class_start[k],
+                                     job->class_start[k+1] - job->class_start[k]);
+    }
+    profile_start (cfg->profile, &timer);
+    job->batches[k] = change_map_compute_all (job->changes);
+    profile_stop (cfg->profile, &timer, "compute",
+                  job->batches[k]->n_segments);
+    profile_count (cfg->profile, "lines", job->batches[k]->n_lines);
+    profile_count (cfg->profile, "segments", job->batches[k]->n_segments);
+  }
+}
+
+/* Stage 3: render and write the output files for each class. */
+static void
+job_write (const ManifestConfig *cfg, Job *job)
+{
+  for (int k = 0; k < cfg->n_classes; k++) {
+    char *out_fn = expand_output_filename (job->out_fn, cfg->classes[k], 1);
+    OutputOptions export_opts;
+    export_opts.filename = out_fn;
+    export_opts.format = job->format[k];
+    export_opts.height = job->height;
+    export_opts.width = job->width;
+    export_opts.origin_row = export_opts.origin_col = 0;
+    export_opts.palette = cfg->palette;
+    export_opts.colour_bins = cfg->colour_bins;
+    export_opts.compress = cfg->compress;
+    export_opts.stripe_rows = cfg->stripe_rows;
+    export_opts.threads = cfg->threads;
+
+    ProfileTimer timer;
+    profile_start (cfg->profile, &timer);
+    export_batch (cfg->mode, job->batches[k], &export_opts);
+    profile_stop (cfg->profile, &timer, "export",
+                  job->batches[k]->n_segments);
+    g_free (out_fn);
+  }
+}
+
+static gpointer
+pipeline_load_thread (gpointer user_data)
+{
+  Pipeline *p = (Pipeline *) user_data;
+  for (guint i = 0; i < p->jobs->len; i++) {
+    g_async_queue_pop (p->slots); /* Wait for a free slot */
+    Job *job = g_ptr_array_index (p->jobs, i);
+    job_load (p->cfg, job);
+    g_async_queue_push (p->loaded, job);
+  }
+  g_async_queue_push (p->loaded, &pipeline_end);
+  return NULL;
+}
+
+static gpointer
+pipeline_compute_thread (gpointer user_data)
+{
+  Pipeline *p = (Pipeline *) user_data;
+  while (1) {
+    Job *job = g_async_queue_pop (p->loaded);
+    if (job != &pipeline_end && job->status == 0) job_compute (p->cfg, job);
+    g_async_queue_push (p->computed, job);
+    if (job == &pipeline_end) break;
+  }
+  return NULL;
+}
+
+/* Run all of the jobs listed in the manifest file fn, with at most
+ * max_in_flight jobs loaded at once.  Returns 0 if all of the jobs
+ * succeeded, or the exit status for the first job that failed. */
+static int
+manifest_run (const char *fn, const ManifestConfig *cfg, int max_in_flight)
+{
+  g_assert (max_in_flight > 0);
+
+  Pipeline p;
+  p.cfg = cfg;
+  p.jobs = manifest_load_check (fn, cfg);
+  p.slots = g_async_queue_new ();
+  p.loaded = g_async_queue_new ();
+  p.computed = g_async_queue_new ();
+
+  for (int i = 0; i < max_in_flight; i++) {
+    g_async_queue_push (p.slots, GINT_TO_POINTER (1));
+  }
+
+  GThread *loader = g_thread_new ("load", pipeline_load_thread, &p);
+  GThread *computer = g_thread_new ("compute", pipeline_compute_thread, &p);
+
+  int status = 0, n_failed = 0;
+  while (1) {
+    Job *job = g_async_queue_pop (p.computed);
+    if (job == &pipeline_end) break;
+    if (job->status == 0) {
+      job_write (cfg, job);
+    } else {
+      fprintf (stderr, "ERROR: %s:%i: Skipping job.\n", fn, job->line);
+      if (n_failed++ == 0) status = job->status;
+    }
+    job_release (job, cfg->n_classes);
+    g_async_queue_push (p.slots, GINT_TO_POINTER (1));
+  }
+
+  g_thread_join (loader);
+  g_thread_join (computer);
+
+  if (n_failed > 0) {
+    fprintf (stderr, "ERROR: %i of %u jobs in '%s' failed.\n",
+             n_failed, p.jobs->len, fn);
+  }
+
+  for (guint i = 0; i < p.jobs->len; i++) {
+    job_free (g_ptr_array_index (p.jobs, i));
+  }
+  g_ptr_array_free (p.jobs, TRUE);
+  g_async_queue_unref (p.slots);
+  g_async_queue_unref (p.loaded);
+  g_async_queue_unref (p.computed);
+  return status;
+}
+
+/* -------------------------------------------------------------------------- */
+
 int
 main (int argc, char **argv)
 {
   int c, status;
   int cfg_mode = MODE_RIDGE_LINES;
-  uint8_t cfg_class = DEFAULT_CLASS_LABEL;
+  uint8_t cfg_classes[256] = {DEFAULT_CLASS_LABEL};
+  int n_classes = 1;
   double cfg_nan = 0;
+  int cfg_threads = 0;
+  int cfg_stream = 0;
+  int cfg_memory = DEFAULT_MEMORY_BUDGET;
+  int cfg_cache = 0;
+  double cfg_calibration = NAN;
+  int cfg_estimator = ESTIMATOR_MEAN;
+  double cfg_estimator_param = 0;
+  int cfg_local_radius = 0;
+  int cfg_compact = 0;
   int cfg_smooth = 0;
   char *cfg_crdg_fn = NULL;
   char *cfg_pre_fn = NULL;
-  char *cfg_post_fn = NULL;
+  char **cfg_post_fns = NULL;
+  int n_posts = 1;
+  int cfg_series = 0;
   char *cfg_out_fn = NULL;
   int cfg_format = FORMAT_NONE;
+  char *cfg_manifest_fn = NULL;
+  int cfg_in_flight = DEFAULT_IN_FLIGHT;
+  char *cfg_palette_fn = NULL;
+  int cfg_bins = 0;
+  int cfg_compress = 0;
+  int cfg_stripe_rows = 0;
+  uint32_t cfg_window[4]; /* ROW, COL, HEIGHT, WIDTH */
+  int cfg_windowed = 0;
+  int cfg_profile = 0;
+  const char *cfg_profile_fn = NULL;
 
   while (1) {
     c = getopt_long (argc, argv, GETOPT_OPTIONS, long_options, NULL);
     if (c == -1) break;
 
     switch (c) {
+    case 'b':
+      cfg_manifest_fn = optarg;
+      break;
+    case 'B':
+      status = sscanf (optarg, "%i", &cfg_bins);
+      if (status != 1 || cfg_bins < 1 || cfg_bins > PALETTE_LUT_SIZE) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to -B option.\n\n",
+                 optarg);
+        usage (argv[0], 1);
+      }
+      break;
     case 'c':
-      status = sscanf (optarg, "%hhu", &cfg_class);
-      if (status != 1) {
+      n_classes = parse_class_labels (optarg, cfg_classes);
+      if (n_classes <= 0) {
         fprintf (stderr, "ERROR: Bad argument '%s' to -c option.\n\n",
                  optarg);
         usage (argv[0], 1);
       }
       break;
+    case 'C':
+      cfg_cache = 1;
+      break;
+    case 'E':
+      if (!parse_estimator (optarg, &cfg_estimator, &cfg_estimator_param)) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to --estimator option.\n\n",
+                 optarg);
+        usage (argv[0], 1);
+      }
+      break;
     case 'h':
       usage (argv[0], 0);
       break;
@@ -231,20 +1108,109 @@ main (int argc, char **argv)
         usage (argv[0], 1);
       }
       break;
+    case 'j':
+      status = sscanf (optarg, "%i", &cfg_threads);
+      if (status != 1 || cfg_threads < 1) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to -j option.\n\n",
+                 optarg);
+        usage (argv[0], 1);
+      }
+      break;
+    case 'k':
+      status = sscanf (optarg, "%lf", &cfg_calibration);
+      if (status != 1 || !isnormal (cfg_calibration) || cfg_calibration <= 0) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to -k option.\n\n",
+                 optarg);
+        usage (argv[0], 1);
+      }
+      break;
+    case 'K':
+      cfg_compact = 1;
+      break;
+    case 'L':
+      {
+        int size;
+        status = sscanf (optarg, "%i", &size);
+        if (status != 1 || size < 3) {
+          fprintf (stderr, "ERROR: Bad argument '%s' to --local-window option.\n\n",
+                   optarg);
+          usage (argv[0], 1);
+        }
+        cfg_local_radius = size / 2;
+      }
+      break;
     case 'm':
       if (strcmp (optarg, "ridgelines") == 0) {
         cfg_mode = MODE_RIDGE_LINES;
       } else if (strcmp (optarg, "ridgemask") == 0) {
         cfg_mode = MODE_RIDGE_MASK;
+      } else if (strcmp (optarg, "table") == 0) {
+        cfg_mode = MODE_TABLE;
+      } else if (strcmp (optarg, "tiles") == 0) {
+        cfg_mode = MODE_TILES;
       } else {
         fprintf (stderr, "ERROR: Bad argument '%s' to -m option.\n\n",
                  optarg);
         usage (argv[0], 1);
       }
       break;
+    case 'M':
+      status = sscanf (optarg, "%i", &cfg_memory);
+      if (status != 1 || cfg_memory < 1) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to -M option.\n\n",
+                 optarg);
+        usage (argv[0], 1);
+      }
+      break;
+    case 'n':
+      status = sscanf (optarg, "%i", &cfg_in_flight);
+      if (status != 1 || cfg_in_flight < 1) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to -n option.\n\n",
+                 optarg);
+        usage (argv[0], 1);
+      }
+      break;
+    case 'p':
+      cfg_palette_fn = optarg;
+      break;
+    case 'P':
+      cfg_profile = 1;
+      cfg_profile_fn = optarg;
+      break;
+    case 'R':
+      status = sscanf (optarg, "%i", &cfg_stripe_rows);
+      if (status != 1 || cfg_stripe_rows < 1) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to -R option.\n\n",
+                 optarg);
+        usage (argv[0], 1);
+      }
+      break;
     case 's':
       cfg_smooth = 1;
       break;
+    case 'S':
+      cfg_stream = 1;
+      break;
+    case 'T':
+      cfg_series = 1;
+      break;
+    case 'w':
+      {
+        char extra;
+        status = sscanf (optarg, "%u,%u,%u,%u%c", &cfg_window[0],
+                         &cfg_window[1], &cfg_window[2], &cfg_window[3],
+                         &extra);
+        if (status != 4 || cfg_window[2] == 0 || cfg_window[3] == 0) {
+          fprintf (stderr, "ERROR: Bad argument '%s' to -w option.\n\n",
+                   optarg);
+          usage (argv[0], 1);
+        }
+        cfg_windowed = 1;
+      }
+      break;
+    case 'z':
+      cfg_compress = 1;
+      break;
 
     case '?':
       usage (argv[0], 1);
@@ -253,8 +1219,77 @@ main (int argc, char **argv)
     }
   }
 
+  /* Profiling can also be turned on from the environment */
+  const char *profile_env = getenv ("RIDGE_CHANGEMAP_PROFILE");
+  if (!cfg_profile && profile_env != NULL) {
+    cfg_profile = 1;
+    if (profile_env[0] != 0 && strcmp (profile_env, "1") != 0) {
+      cfg_profile_fn = profile_env;
+    }
+  }
+  Profile *profile = cfg_profile ? profile_new () : NULL;
+
+  if (cfg_local_radius > 0
+      && (cfg_stream || cfg_cache || !isnan (cfg_calibration)
+          || cfg_estimator != ESTIMATOR_MEAN)) {
+    fprintf (stderr, "ERROR: Local calibration cannot be used with stream mode,\n"
+             "a calibration cache, a calibration value or an estimator.\n\n");
+    usage (argv[0], 1);
+  }
+
+  /* Load colour palette */
+  Palette *palette;
+  if (cfg_palette_fn != NULL) {
+    palette = palette_load (cfg_palette_fn);
+    if (palette == NULL) {
+      fprintf (stderr, "ERROR: Failed to load palette from '%s'.\n",
+               cfg_palette_fn);
+      exit (1);
+    }
+  } else {
+    palette = palette_new_default ();
+  }
+
+  /* Batch mode */
+  if (cfg_manifest_fn != NULL) {
+    if (argc > optind) {
+      fprintf (stderr, "ERROR: Filenames cannot be given with a manifest.\n\n");
+      usage (argv[0], 1);
+    }
+    if (cfg_stream || cfg_series || cfg_windowed) {
+      fprintf (stderr, "ERROR: Stream, series and window modes cannot be used\n"
+               "with a manifest.\n\n");
+      usage (argv[0], 1);
+    }
+
+    ManifestConfig manifest_cfg;
+    manifest_cfg.mode = cfg_mode;
+    manifest_cfg.classes = cfg_classes;
+    manifest_cfg.n_classes = n_classes;
+    manifest_cfg.nan_val = cfg_nan;
+    manifest_cfg.threads = cfg_threads;
+    manifest_cfg.cache = cfg_cache;
+    manifest_cfg.calibration = cfg_calibration;
+    manifest_cfg.estimator = cfg_estimator;
+    manifest_cfg.estimator_param = cfg_estimator_param;
+    manifest_cfg.local_radius = cfg_local_radius;
+    manifest_cfg.compact = cfg_compact;
+    manifest_cfg.budget = (size_t) cfg_memory << 20;
+    manifest_cfg.format = cfg_format;
+    manifest_cfg.palette = palette;
+    manifest_cfg.colour_bins = cfg_bins;
+    manifest_cfg.compress = cfg_compress;
+    manifest_cfg.stripe_rows = cfg_stripe_rows;
+    manifest_cfg.profile = profile;
+    status = manifest_run (cfg_manifest_fn, &manifest_cfg, cfg_in_flight);
+    profile_report_check (profile, cfg_profile_fn);
+    profile_free (profile);
+    palette_free (palette);
+    return status;
+  }
+
   /* Get filenames */
-  if (argc - optind < 4) {
+  if (argc - optind < 4 || (!cfg_series && argc - optind > 4)) {
     fprintf (stderr,
              "ERROR: You must specify a ridge data file, pre- and post-event SAR\n"
              "images, and an output filename.\n\n");
@@ -263,58 +1298,288 @@ main (int argc, char **argv)
 
   cfg_crdg_fn = argv[optind++];
   cfg_pre_fn = argv[optind++];
-  cfg_post_fn = argv[optind++];
+  n_posts = argc - optind - 1;
+  cfg_post_fns = argv + optind;
+  optind += n_posts;
   cfg_out_fn = argv[optind++];
 
+  if (n_classes > 1 && !output_template_has (cfg_out_fn, 'c')) {
+    fprintf (stderr,
+             "ERROR: OUTFILE must contain '%%c' when more than one class label\n"
+             "is specified.\n\n");
+    usage (argv[0], 1);
+  }
+  if (n_posts > 1 && !output_template_has (cfg_out_fn, 'e')) {
+    fprintf (stderr,
+             "ERROR: OUTFILE must contain '%%e' when more than one post-event\n"
+             "image is specified.\n\n");
+    usage (argv[0], 1);
+  }
+  if (n_posts > 1 && cfg_stream) {
+    fprintf (stderr, "ERROR: Stream mode cannot be used with several post-event\n"
+             "images.\n\n");
+    usage (argv[0], 1);
+  }
+  if (cfg_windowed && cfg_stream) {
+    fprintf (stderr, "ERROR: Stream mode cannot be used with a window.\n\n");
+    usage (argv[0], 1);
+  }
+  if (cfg_compact && cfg_stream) {
+    fprintf (stderr, "ERROR: Stream mode cannot be used with compact images.\n\n");
+    usage (argv[0], 1);
+  }
+
   /* Initialise change map structure */
   ChangeMap *changes = change_map_new ();
   change_map_set_nan (changes, cfg_nan);
+  change_map_set_threads (changes, cfg_threads);
+  change_map_set_estimator (changes, cfg_estimator, cfg_estimator_param);
+  change_map_set_local_calibration (changes, cfg_local_radius);
 
   /* Load & check ridge data */
   uint32_t height, width;
-  RioData *ridges = ridges_load_check (cfg_crdg_fn, cfg_class, &height, &width);
+  uint32_t *selection;
+  size_t class_start[257];
+  ProfileTimer timer;
+  profile_start (profile, &timer);
+  RioData *ridges = ridges_load_check (cfg_crdg_fn, cfg_classes, n_classes,
+                                       &height, &width,
+                                       &selection, class_start);
   change_map_set_ridge_data (changes, ridges);
+  profile_stop (profile, &timer, "load_ridges",
+                rio_data_get_num_entries (ridges));
+
+  /* Restrict to window, clipped to the image */
+  if (cfg_windowed) {
+    if (cfg_window[0] >= height || cfg_window[1] >= width) {
+      fprintf (stderr, "ERROR: Window lies outside the %ux%u image.\n",
+               height, width);
+      exit (1);
+    }
+    cfg_window[2] = MIN (cfg_window[2], height - cfg_window[0]);
+    cfg_window[3] = MIN (cfg_window[3], width - cfg_window[1]);
+    profile_start (profile, &timer);
+    select_window (ridges, height, width, cfg_window, n_classes,
+                   &selection, class_start);
+    profile_stop (profile, &timer, "select_window", class_start[n_classes]);
+    change_map_set_window (changes, cfg_window[0], cfg_window[1],
+                           cfg_window[2], cfg_window[3]);
+  }
+  const uint32_t *window = cfg_windowed ? cfg_window : NULL;
+  uint32_t out_height = window ? window[2] : height;
+  uint32_t out_width = window ? window[3] : width;
+  uint64_t n_pixels = (uint64_t) out_height * out_width;
+
+  /* Look up cached calibration values */
+  double *calibrations = g_new (double, n_posts);
+  char **cache_fns = g_new0 (char *, n_posts);
+  char **cache_keys = g_new0 (char *, n_posts);
+  int n_uncalibrated = 0;
+  for (int e = 0; e < n_posts; e++) {
+    calibrations[e] = cfg_calibration;
+    if (isnan (calibrations[e]) && cfg_cache) {
+      cache_fns[e] = calibration_cache_filename (cfg_post_fns[e]);
+      cache_keys[e] = calibration_cache_key (cfg_pre_fn, cfg_post_fns[e],
+                                             cfg_nan, cfg_estimator,
+                                             cfg_estimator_param,
+                                             cfg_compact);
+      if (cache_keys[e] != NULL
+          && calibration_cache_lookup (cache_fns[e], cache_keys[e],
+                                       &calibrations[e])) {
+        /* Cache hit; nothing to store */
+        g_free (cache_keys[e]);
+        cache_keys[e] = NULL;
+      }
+    }
+    if (isnan (calibrations[e]) && cfg_local_radius == 0) n_uncalibrated++;
+  }
 
   /* Load & check pre/post SAR images */
-  RutSurface *pre, *post;
-  pre = img_load_check (cfg_pre_fn, height, width);
-  change_map_set_pre_image (changes, pre);
-  post = img_load_check (cfg_post_fn, height, width);
-  change_map_set_post_image (changes, post);
+  RutSurface *pre = NULL;
+  RutSurface **posts = g_new0 (RutSurface *, n_posts);
+  CompactImage *pre_compact = NULL;
+  CompactImage **posts_compact = g_new0 (CompactImage *, n_posts);
+  StreamImage *pre_s = NULL, *post_s = NULL;
+  size_t budget = (size_t) cfg_memory << 20;
+  if (cfg_stream) {
+    /* A strip of each image may be buffered at the same time */
+    pre_s = stream_load_check (cfg_pre_fn, height, width, budget / 2);
+    post_s = stream_load_check (cfg_post_fns[0], height, width, budget / 2);
+    if (isnan (calibrations[0])) {
+      /* The calibration pass buffers at least one band of rows of
+       * each image, as well as any decoded strips. */
+      size_t min_budget = (stream_image_get_strip_size (pre_s)
+                           + stream_image_get_strip_size (post_s)
+                           + 2 * (size_t) MIN (CALIBRATION_BAND_ROWS, height)
+                           * width * sizeof (float));
+      if (budget < min_budget) {
+        fprintf (stderr, "ERROR: Stream calibration needs at least %zu MiB, which is\n"
+                 "more than the memory budget set by -M.\n",
+                 (min_budget + 0xfffff) >> 20);
+        exit (1);
+      }
+      profile_start (profile, &timer);
+      if (!change_map_stream_calibrate (changes, pre_s, post_s, budget)) {
+        fprintf (stderr, "ERROR: Failed to read image data from '%s' or '%s'.\n",
+                 cfg_pre_fn, cfg_post_fns[0]);
+        exit (3);
+      }
+      calibrations[0] = change_map_calibrate (changes);
+      profile_stop (profile, &timer, "calibrate", n_pixels);
+      profile_count (profile, "pixels", 2 * n_pixels);
+    }
+  } else if (cfg_compact) {
+    profile_start (profile, &timer);
+    pre_compact = compact_load_check (cfg_pre_fn, height, width, window,
+                                      budget);
+    for (int e = 0; e < n_posts; e++) {
+      posts_compact[e] = compact_load_check (cfg_post_fns[e], height, width,
+                                             window, budget);
+    }
+    profile_stop (profile, &timer, "load_images", (n_posts + 1) * n_pixels);
+    profile_count (profile, "pixels", (n_posts + 1) * n_pixels);
 
-  /* Figure out desired output file format */
-  /* FIXME should be an explicit command-line option */
-  if (cfg_format == FORMAT_NONE) {
-    cfg_format = guess_output_format (cfg_out_fn);
+    /* Compact images are calibrated one post-event image at a time */
+    profile_start (profile, &timer);
+    for (int e = 0; e < n_posts; e++) {
+      if (!isnan (calibrations[e]) || cfg_local_radius > 0) continue;
+      change_map_set_compact_images (changes, pre_compact, posts_compact[e]);
+      calibrations[e] = change_map_calibrate (changes);
+    }
+    profile_stop (profile, &timer, "calibrate", n_uncalibrated * n_pixels);
+  } else {
+    profile_start (profile, &timer);
+    pre = img_load_check (cfg_pre_fn, height, width, window, budget);
+    change_map_set_pre_image (changes, pre);
+    for (int e = 0; e < n_posts; e++) {
+      posts[e] = img_load_check (cfg_post_fns[e], height, width, window,
+                                 budget);
+    }
+    profile_stop (profile, &timer, "load_images", (n_posts + 1) * n_pixels);
+    profile_count (profile, "pixels", (n_posts + 1) * n_pixels);
+
+    /* Calibrate all of the post-event images that need it in a
+     * single pass over the pre-event image. */
+    if (n_uncalibrated > 0) {
+      RutSurface **uncal_posts = g_new (RutSurface *, n_uncalibrated);
+      double *uncal_values = g_new (double, n_uncalibrated);
+      for (int e = 0, i = 0; e < n_posts; e++) {
+        if (isnan (calibrations[e])) uncal_posts[i++] = posts[e];
+      }
+      profile_start (profile, &timer);
+      change_map_calibrate_series (changes, uncal_posts, n_uncalibrated,
+                                   uncal_values);
+      profile_stop (profile, &timer, "calibrate", n_uncalibrated * n_pixels);
+      for (int e = 0, i = 0; e < n_posts; e++) {
+        if (isnan (calibrations[e])) calibrations[e] = uncal_values[i++];
+      }
+      g_free (uncal_posts);
+      g_free (uncal_values);
+    }
   }
-  if (cfg_format == FORMAT_NONE) {
-    fprintf (stderr, "WARNING: Could not guess output format for '%s'. Using PDF.\n",
-             cfg_out_fn);
-    cfg_format = FORMAT_PDF;
+
+  /* Update calibration cache.  Cached values are for the whole scene,
+   * so values calibrated over a window are not stored. */
+  for (int e = 0; e < n_posts; e++) {
+    if (cache_keys[e] != NULL && !cfg_windowed
+        && !calibration_cache_store (cache_fns[e], cache_keys[e],
+                                     calibrations[e])) {
+      fprintf (stderr, "WARNING: Could not write calibration cache '%s'.\n",
+               cache_fns[e]);
+    }
+    g_free (cache_fns[e]);
+    g_free (cache_keys[e]);
   }
+  g_free (cache_fns);
+  g_free (cache_keys);
+
+  /* Figure out desired output file format */
+  cfg_format = output_format_check (cfg_mode, cfg_format, cfg_out_fn);
 
-  /* Output! */
-  OutputOptions export_opts;
-  export_opts.filename = cfg_out_fn;
-  export_opts.format = cfg_format;
-  export_opts.height = height;
-  export_opts.width = width;
+  /* Output!  The ridge data, pre-event image and calibrations are
+   * shared by all of the epochs and class labels. */
+  for (int e = 0; e < n_posts; e++) {
+    if (cfg_compact) {
+      change_map_set_compact_images (changes, pre_compact, posts_compact[e]);
+    } else if (!cfg_stream) {
+      change_map_set_post_image (changes, posts[e]);
+    }
+    if (cfg_local_radius == 0) {
+      change_map_set_calibration (changes, calibrations[e]);
+    }
 
-  switch (cfg_mode) {
-  case MODE_RIDGE_LINES:
-    export_ridge_lines (changes, &export_opts);
-    break;
-  case MODE_RIDGE_MASK:
-    export_ridge_mask (changes, &export_opts);
-    break;
-  default:
-    g_assert_not_reached ();
-  };
+    for (int k = 0; k < n_classes; k++) {
+      if (selection != NULL) {
+        change_map_set_line_selection (changes, selection + class_start[k],
+                                       class_start[k+1] - class_start[k]);
+      }
+      if (cfg_stream) {
+        profile_start (profile, &timer);
+        if (!change_map_stream (changes, pre_s, post_s, budget)) {
+          fprintf (stderr, "ERROR: Failed to read image data from '%s' or '%s'.\n",
+                   cfg_pre_fn, cfg_post_fns[0]);
+          exit (3);
+        }
+        /* change_map_stream() leaves the per-segment changes in the map */
+        size_t n_segments =
+          changes->segment_offsets[change_map_get_num_lines (changes)];
+        profile_stop (profile, &timer, "compute", n_segments);
+        profile_count (profile, "pixels", 2 * n_pixels);
+      }
+
+      char *out_fn = expand_output_filename (cfg_out_fn, cfg_classes[k], e + 1);
+      OutputOptions export_opts;
+      export_opts.filename = out_fn;
+      export_opts.format = cfg_format;
+      export_opts.height = out_height;
+      export_opts.width = out_width;
+      export_opts.origin_row = window ? window[0] : 0;
+      export_opts.origin_col = window ? window[1] : 0;
+      export_opts.palette = palette;
+      export_opts.colour_bins = cfg_bins;
+      export_opts.compress = cfg_compress;
+      export_opts.stripe_rows = cfg_stripe_rows;
+      export_opts.threads = cfg_threads;
+
+      if (cfg_mode == MODE_RIDGE_LINES
+          && (cfg_format == FORMAT_SVG || cfg_format == FORMAT_GEOJSON)) {
+        /* Vector formats can be written as each line is computed */
+        profile_start (profile, &timer);
+        export_ridge_lines_stream (changes, &export_opts);
+        profile_stop (profile, &timer, "export", 0);
+        profile_count (profile, "lines", change_map_get_num_lines (changes));
+      } else {
+        profile_start (profile, &timer);
+        ChangeMapBatch *batch = change_map_compute_all (changes);
+        profile_stop (profile, &timer, "compute", batch->n_segments);
+        profile_count (profile, "lines", batch->n_lines);
+        profile_count (profile, "segments", batch->n_segments);
+
+        profile_start (profile, &timer);
+        export_batch (cfg_mode, batch, &export_opts);
+        profile_stop (profile, &timer, "export", batch->n_segments);
+        change_map_batch_free (batch);
+      }
+      g_free (out_fn);
+    }
+  }
 
   /* Cleanup */
+  stream_image_close (pre_s);
+  stream_image_close (post_s);
   change_map_free (changes);
   rio_data_destroy (ridges);
-  rut_surface_destroy (pre);
-  rut_surface_destroy (post);
+  g_free (selection);
+  g_free (calibrations);
+  image_destroy (pre);
+  for (int e = 0; e < n_posts; e++) image_destroy (posts[e]);
+  g_free (posts);
+  compact_image_free (pre_compact);
+  for (int e = 0; e < n_posts; e++) compact_image_free (posts_compact[e]);
+  g_free (posts_compact);
+  palette_free (palette);
+
+  profile_report_check (profile, cfg_profile_fn);
+  profile_free (profile);
   return 0;
 }
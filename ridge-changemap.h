@@ -18,17 +18,40 @@
 
 typedef struct _ChangeMap ChangeMap;
 typedef struct _ChangeMapLine ChangeMapLine;
+typedef struct _ChangeMapBatch ChangeMapBatch;
+typedef struct _Calibrator Calibrator;
+typedef struct _StreamImage StreamImage;
+typedef struct _CompactImage CompactImage;
+
+/* Statistics of the square ratio image used as the calibration */
+enum CalibrationEstimator {
+  ESTIMATOR_MEAN,
+  ESTIMATOR_QUANTILE, /* Parameter is the quantile; 0.5 for median */
+  ESTIMATOR_TRIMMED,  /* Parameter is the fraction trimmed from each end */
+};
 
 struct _ChangeMap {
   /* --- Set by user --- */
   RioData *ridges;
+  const uint32_t *selection; /* Array of length n_selected, or NULL */
+  size_t n_selected;
   RutSurface *pre;
   RutSurface *post;
+  const CompactImage *pre_compact; /* Used instead of pre, if set */
+  const CompactImage *post_compact; /* Used instead of post, if set */
   double nan_val;
+  int threads;
+  int estimator;
+  double estimator_param;
+  int local_radius; /* If non-zero, calibrate over a local window */
 
   /* --- Generated internally --- */
   int height, width;
+  int origin_row, origin_col; /* Top left corner of window, if any */
   double calibration;
+  GMutex calibration_lock;
+  size_t *segment_offsets; /* Array of length n_lines+1 */
+  float *segment_changes;
 };
 
 struct _ChangeMapLine {
@@ -37,24 +60,263 @@ struct _ChangeMapLine {
   float *change;
 };
 
+/* Change values for all ridge lines, in structure-of-arrays form.
+ * The segments of line i are numbered offsets[i] to offsets[i+1]-1,
+ * and segment s of line i runs from point s+i to point s+i+1. */
+struct _ChangeMapBatch {
+  size_t n_lines;
+  size_t n_segments;
+  size_t *offsets;     /* Array of length n_lines+1 */
+  uint32_t *coords[2]; /* Arrays of length n_segments+n_lines */
+  float *change;       /* Array of length n_segments */
+  double calibration;
+  float *calibrations; /* Local calibration of each segment, or NULL */
+  const uint32_t *selection; /* Ridge index of each line, or NULL */
+};
+
 ChangeMap *change_map_new (void);
 void change_map_free (ChangeMap *map);
 void change_map_set_ridge_data (ChangeMap *map, RioData *data);
+void change_map_set_line_selection (ChangeMap *map, const uint32_t *selection,
+                                    size_t n);
+void change_map_set_window (ChangeMap *map, int row, int col,
+                            int height, int width);
+size_t change_map_get_num_lines (ChangeMap *map);
+RioLine *change_map_get_ridge_line (ChangeMap *map, size_t index);
 void change_map_set_pre_image (ChangeMap *map, RutSurface *pre);
 void change_map_set_post_image (ChangeMap *map, RutSurface *post);
+void change_map_set_compact_images (ChangeMap *map, const CompactImage *pre,
+                                    const CompactImage *post);
 void change_map_set_nan (ChangeMap *map, double nan_val);
+void change_map_set_threads (ChangeMap *map, int threads);
+void change_map_set_estimator (ChangeMap *map, int estimator, double param);
+void change_map_set_local_calibration (ChangeMap *map, int radius);
+void change_map_set_calibration (ChangeMap *map, double calibration);
+double change_map_calibrate (ChangeMap *map);
+void change_map_calibrate_series (ChangeMap *map, RutSurface **posts,
+                                  int n_posts, double *calibrations);
+void change_map_set_segment_changes (ChangeMap *map, size_t *offsets,
+                                     float *changes);
 ChangeMapLine *change_map_get_line (ChangeMap *map, int index);
 
+ChangeMapBatch *change_map_compute_all (ChangeMap *map);
+
 void change_map_line_free (ChangeMapLine *line);
 void change_map_line_get_pixel (const ChangeMapLine *line, int segment,
                                 int *row, int *col);
 
+void change_map_batch_free (ChangeMapBatch *batch);
+void change_map_batch_get_pixel (const ChangeMapBatch *batch, size_t line,
+                                 size_t segment, int *row, int *col);
+
+/* Find the pixel sampled by the segment between two ridge points.
+ * Ridge coordinates are fixed point, with 7 fractional bits. */
+static inline void
+change_map_segment_pixel (uint32_t row0, uint32_t col0,
+                          uint32_t row1, uint32_t col1,
+                          int *row, int *col)
+{
+  *row = (int) (((uint64_t) row0 + (uint64_t) row1) >> 8);
+  *col = (int) (((uint64_t) col0 + (uint64_t) col1) >> 8);
+}
+
+/* ---------------------------------------------------------------- */
+
+/* Calibration is accumulated over bands of this many rows */
+#define CALIBRATION_BAND_ROWS 64
+
+Calibrator *calibrator_new (int height, int width, double nan_val,
+                            int threads);
+Calibrator *calibrator_new_series (int height, int width, double nan_val,
+                                   int n_posts, int threads);
+void calibrator_free (Calibrator *cal);
+void calibrator_set_estimator (Calibrator *cal, int estimator, double param);
+void calibrator_add_rows (Calibrator *cal, int first_row, int n_rows,
+                          const float * const *pre_rows,
+                          const float * const *post_rows);
+void calibrator_add_compact_rows (Calibrator *cal, int first_row, int n_rows,
+                                  const uint16_t * const *pre_rows,
+                                  const uint16_t * const *post_rows);
+double calibrator_finish (Calibrator *cal);
+void calibrator_finish_series (Calibrator *cal, double *calibrations);
+
+/* ---------------------------------------------------------------- */
+
+char *calibration_cache_filename (const char *post_fn);
+char *calibration_cache_key (const char *pre_fn, const char *post_fn,
+                             double nan_val, int estimator, double param,
+                             int compact);
+int calibration_cache_lookup (const char *cache_fn, const char *key,
+                              double *value);
+int calibration_cache_store (const char *cache_fn, const char *key,
+                             double value);
+
+/* ---------------------------------------------------------------- */
+
+int image_get_tiff_size (const char *filename, uint32_t *rows, uint32_t *cols);
+RutSurface *image_map_tiff (const char *filename);
+RutSurface *image_load_tiff (const char *filename);
+void image_destroy (RutSurface *surface);
+
+/* ---------------------------------------------------------------- */
+
+StreamImage *stream_image_open (const char *filename);
+void stream_image_close (StreamImage *img);
+void stream_image_get_size (const StreamImage *img,
+                            uint32_t *rows, uint32_t *cols);
+size_t stream_image_get_strip_size (const StreamImage *img);
+int stream_image_read_row (StreamImage *img, int row, float *buf);
+RutSurface *stream_image_read_window (StreamImage *img, int row, int col,
+                                      int height, int width);
+int change_map_stream_calibrate (ChangeMap *map, StreamImage *pre,
+                                 StreamImage *post, size_t budget);
+int change_map_stream (ChangeMap *map, StreamImage *pre, StreamImage *post,
+                       size_t budget);
+
+/* ---------------------------------------------------------------- */
+
+struct _CompactImage {
+  int rows, cols;
+  uint16_t *data; /* Row-major, with no padding */
+};
+
+#define COMPACT_IMAGE_ROW(img, r) ((img)->data + (size_t) (r) * (img)->cols)
+
+extern float compact_decode_table[1 << 16];
+
+/* Return the value for a compact image pixel code. */
+static inline float
+compact_decode (uint16_t code)
+{
+  return compact_decode_table[code];
+}
+
+uint16_t compact_encode (float v);
+void compact_decode_row (const uint16_t *codes, int n, float *buf);
+CompactImage *compact_image_read (StreamImage *img, int row, int col,
+                                  int height, int width);
+void compact_image_free (CompactImage *img);
+
+/* ---------------------------------------------------------------- */
+
+typedef struct _Profile Profile;
+typedef struct _ProfileTimer ProfileTimer;
+
+struct _ProfileTimer {
+  gint64 wall, cpu; /* Microseconds */
+};
+
+Profile *profile_new (void);
+void profile_free (Profile *p);
+void profile_start (Profile *p, ProfileTimer *t);
+void profile_stop (Profile *p, ProfileTimer *t, const char *name,
+                   uint64_t n_items);
+void profile_count (Profile *p, const char *name, uint64_t n);
+int profile_report (Profile *p, const char *filename);
+
+/* ---------------------------------------------------------------- */
+
+typedef void (*ParallelFunc) (int thread, int n_threads, void *user_data);
+typedef void (*ParallelRangeFunc) (size_t start, size_t end, void *user_data);
+
+int parallel_default_threads (void);
+void parallel_run (int n_threads, ParallelFunc func, void *user_data);
+void parallel_for_stealing (int n_threads, size_t n_items, size_t grain,
+                            ParallelRangeFunc func, void *user_data);
+
+/* ---------------------------------------------------------------- */
+
+double kernel_square_ratio (double num, double den, double nan_val);
+double kernel_square_ratio_sum (const float *pre, const float *post,
+                                int n, double nan_val);
+
+/* Square ratio sum kernels, which can be chosen explicitly for
+ * testing */
+enum SquareRatioSumKernel {
+  KERNEL_SCALAR,
+  KERNEL_SSE2,
+  KERNEL_AVX2,
+  KERNEL_N_KERNELS,
+};
+
+int kernel_square_ratio_sum_supported (int kernel);
+double kernel_square_ratio_sum_with (int kernel,
+                                     const float *pre, const float *post,
+                                     int n, double nan_val);
+
+/* Number of bins in a square ratio histogram */
+#define KERNEL_HISTOGRAM_BINS (64 << 8)
+
+void kernel_square_ratio_accumulate (const float *pre, const float *post,
+                                     int n, double nan_val, double scale,
+                                     double *acc);
+void kernel_square_ratio_histogram (const float *pre, const float *post,
+                                    int n, double nan_val, uint64_t *hist);
+double kernel_histogram_bin_edge (int bin);
+
+/* ---------------------------------------------------------------- */
+
+/* Number of entries in a palette's colour lookup table */
+#define PALETTE_LUT_SIZE 4096
+
+typedef struct _Palette Palette;
+
+struct _Palette {
+  uint32_t background; /* Packed 0xRRGGBB */
+  double scale; /* Lookup table entries per unit change */
+  uint32_t lut[PALETTE_LUT_SIZE];
+};
+
+Palette *palette_new_default (void);
+Palette *palette_load (const char *filename);
+void palette_free (Palette *palette);
+
+/* Return the packed 0xRRGGBB colour for change value d.  Negative and
+ * NaN values get the colour for no change. */
+static inline uint32_t
+palette_lookup (const Palette *palette, double d)
+{
+  double x = d * palette->scale;
+  if (!(x > 0)) return palette->lut[0];
+  if (x >= PALETTE_LUT_SIZE - 1) return palette->lut[PALETTE_LUT_SIZE - 1];
+  return palette->lut[(int) (x + 0.5)];
+}
+
+/* ---------------------------------------------------------------- */
+
+typedef struct _RidgePixel RidgePixel;
+
+struct _RidgePixel {
+  uint32_t row, col;
+  float change;
+};
+
+RidgePixel *ridge_pixels_bucket (const ChangeMapBatch *batch,
+                                 size_t row0, size_t col0,
+                                 size_t height, size_t width,
+                                 size_t band_rows, size_t **band_start);
+
+/* ---------------------------------------------------------------- */
+
+typedef struct _RidgeIndex RidgeIndex;
+
+RidgeIndex *ridge_index_new (RioData *ridges, uint32_t height, uint32_t width);
+void ridge_index_free (RidgeIndex *index);
+uint32_t *ridge_index_query (const RidgeIndex *index, uint32_t row,
+                             uint32_t col, uint32_t height, uint32_t width,
+                             size_t *n);
+
 /* ---------------------------------------------------------------- */
 
 enum OutputFormat {
   FORMAT_NONE,
   FORMAT_PDF,
   FORMAT_PNG,
+  FORMAT_SVG,
+  FORMAT_GEOJSON,
+  FORMAT_TABLE,
+  FORMAT_CSV,
+  FORMAT_TIFF,
 };
 
 typedef struct _OutputOptions OutputOptions;
@@ -63,7 +325,28 @@ struct _OutputOptions {
   const char *filename;
   int format;
   size_t height, width;
+  size_t origin_row, origin_col; /* Ridge coordinates of top left corner */
+  const Palette *palette;
+  int colour_bins; /* If non-zero, number of colours for line drawing */
+  int compress; /* Compress raster output */
+  size_t stripe_rows; /* If non-zero, render PNG output in stripes */
+  int threads;
 };
 
-void export_ridge_lines (ChangeMap *map, OutputOptions *cfg);
-void export_ridge_mask (ChangeMap *map, OutputOptions *cfg);
+void export_ridge_lines (const ChangeMapBatch *batch, OutputOptions *cfg);
+void export_ridge_mask (const ChangeMapBatch *batch, OutputOptions *cfg);
+void export_ridge_lines_vector (const ChangeMapBatch *batch,
+                                OutputOptions *cfg);
+void export_ridge_lines_stream (ChangeMap *map, OutputOptions *cfg);
+void export_ridge_mask_tiff (const ChangeMapBatch *batch, OutputOptions *cfg);
+void export_change_table (const ChangeMapBatch *batch, OutputOptions *cfg);
+void export_tile_pyramid (const ChangeMapBatch *batch, OutputOptions *cfg);
+
+/* ---------------------------------------------------------------- */
+
+typedef struct _PngWriter PngWriter;
+
+PngWriter *png_writer_open (const char *filename, size_t width, size_t height);
+void png_writer_write_rows (PngWriter *w, const uint32_t *pixels,
+                            size_t stride, size_t n_rows);
+void png_writer_close (PngWriter *w);